@@ -4,22 +4,125 @@
 #include <mpi.h>
 #include <stdint.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#define HAVE_MMAP
+#endif
+
+// Kernels are (2 * radius + 1) x (2 * radius + 1).
+#define MAX_KERNEL_RADIUS 15
+#define MAX_KERNEL_SIZE (2 * MAX_KERNEL_RADIUS + 1)
+// Columns per pass of the separable convolution.
+#define SEPARABLE_CHUNK 256
+// Cache that the tiles of the skewed sweep should fit in.
+#define L2_CACHE_SIZE (512 * 1024)
+// Rows of the inner block computed (per thread) between two checks on the halo exchange.
+#define POLL_ROWS 16
+// Most bytes of the image per collective read / write, see Read_data().
+#define IO_CHUNK_BYTES (4 * 1024 * 1024)
+// Room for the --io-hint options.
+#define MAX_IO_HINTS 512
+// Room for the --output path.
+#define MAX_OUTPUT_PATH 1024
+// Stages of the --pipeline.
+#define MAX_STAGES 16
+// Max error, relative to the largest element, for a kernel to be treated as separable.
+#define SEPARABLE_TOLERANCE 1e-5f
+// Max sum, relative to the sum of the absolute weights, for a --kernel to be treated as summing to 0.
+#define ZERO_SUM_TOLERANCE 1e-6f
 
 typedef struct image_info {
 	int cols;
 	int rows;
 	int bytes_per_pixel;
+	// Padding rows / columns on each side of a color plane.
+	int padding;
 } image_info_t;
 
+// How the image files are read / written.
+enum {
+	IO_MPI,   // MPI-IO, collectively
+	IO_MMAP   // each process maps its rows of the files (only on 1 node, or a shared file system that supports it)
+};
+
+// Kernels of the --pipeline stages.
+enum {
+	KERNEL_GAUSSIAN,  // blur, binomial weights
+	KERNEL_BOX,       // blur, equal weights
+	KERNEL_SHARPEN,   // 3x3, 5 at the center and -1 at the 4 sides
+	KERNEL_CUSTOM     // the --kernel
+};
+
+// How the --kernel is normalized.
+enum {
+	NORMALIZE_AUTO,  // to a sum of 1, unless it sums to 0 (edge detectors, like the Laplacian)
+	NORMALIZE_ON,
+	NORMALIZE_OFF
+};
+
+// How the halos are exchanged.
+enum {
+	EXCHANGE_NEIGHBOR,  // one MPI_Ineighbor_alltoallw on the cartesian communicator
+	EXCHANGE_P2P        // MPI_Isend / MPI_Irecv per neighbor
+};
+
 typedef struct input_data {
 	int width;
 	int height;
 	int bytes_per_pixel;
 	int times;
+	// Stop when the image stops changing, checked every sim_flag iterations, 0 for never.
 	int sim_flag;
+	int radius;
+	// The --pipeline: kernel, radius and iterations of each stage. 'times' is how many
+	// passes go through all of them.
+	int stages;
+	int stage_kernel[MAX_STAGES];
+	int stage_radius[MAX_STAGES];
+	int stage_count[MAX_STAGES];
+	// The weights of the --kernel, row by row (size 0 if there is none), normalized, and the
+	// --bias that is added to its result.
+	int kernel_size;
+	float kernel_weights[MAX_KERNEL_SIZE * MAX_KERNEL_SIZE];
+	float kernel_bias;
+	int steps_per_exchange;
+	int tile_rows;
+	int threads;
+	int exchange;
+	int packed_halos;
+	// 8 to exchange the corners with the diagonal neighbors too, 4 otherwise.
+	int halo_sides;
+	int io;
+	// Frames of the image, one after the other in the input (and output) file.
+	int frames;
+	// MPI-IO hints for the image files, as key=value;key=value.
+	char io_hints[MAX_IO_HINTS];
 	char *input_file;
+	char output_file[MAX_OUTPUT_PATH];
+	// Where the image is written before it replaces output_file, see Write_data().
+	char temp_file[MAX_OUTPUT_PATH + 32];
 } input_data_t;
 
+typedef struct kernel {
+	int radius;
+	int size;
+	float matrix[MAX_KERNEL_SIZE * MAX_KERNEL_SIZE];
+	// If separable, matrix[i * size + j] == col[i] * row[j].
+	int separable;
+	float col[MAX_KERNEL_SIZE];
+	float row[MAX_KERNEL_SIZE];
+	// Added to the result of every pixel.
+	float bias;
+} kernel_t;
+
 ///        DIMENSION DIVISION AND USAGE        ///
 
 void split_helper(int width, int height, int ps, int width_div, int *pbest_div, int *pper_min) {
@@ -29,16 +132,14 @@ void split_helper(int width, int height, int ps, int width_div, int *pbest_div,
 	best_div = *pbest_div;
 	per_min = *pper_min;
 
-	if(width % width_div == 0) {
-        height_div = ps / width_div;
-
-        if(height % height_div == 0) {
-			int curr_per = width / width_div + height / height_div;
-
-            if(curr_per < per_min) {
-				per_min = curr_per;
-				best_div = width_div;
-			}
+	height_div = ps / width_div;
+	// Every block needs at least 1 row and column.
+	if(width_div <= width && height_div <= height) {
+		// Perimeter of the largest blocks.
+		int curr_per = (width + width_div - 1) / width_div + (height + height_div - 1) / height_div;
+		if(curr_per < per_min) {
+			per_min = curr_per;
+			best_div = width_div;
 		}
 	}
 
@@ -47,23 +148,19 @@ void split_helper(int width, int height, int ps, int width_div, int *pbest_div,
 }
 
 
-// Divide image in 'ps' equal rectangles so that the perimeter
+// Divide image in 'ps' rectangles so that the perimeter
 // of each rectangle is minimized (in order to minimize
 // the exchange of data between processes).
+// The rectangles don't need to be equal, see block_size().
 // This procedure is serial, it's supposed to be called from process 0.
 int split_dimensions(int width, int height, int ps) {
 	int width_div;
 	int best_div, per_min;
-	int inc;
 
 	best_div = 0;
-	per_min = height + width + 1;
+	per_min = height + width + 2;
 
-	inc = 1;
-	if(width % 2)
-		inc = 2;
-
-    for(width_div = 1; width_div*width_div <= ps; width_div += inc) {
+	for(width_div = 1; width_div*width_div <= ps; ++width_div) {
 		if(!(ps % width_div)) {
 			// NOTE(maria): We have extra call on perfect squares.
 			split_helper(width, height, ps, width_div, &best_div, &per_min);
@@ -74,33 +171,412 @@ int split_dimensions(int width, int height, int ps) {
 	return best_div;
 }
 
+// Split 'length' pixels in 'parts' blocks whose sizes differ by at most 1
+// (the first length % parts blocks get 1 more pixel).
+// Return the size of block 'index' and store where it starts in *pstart.
+int block_size(int length, int parts, int index, int *pstart) {
+	int size = length / parts;
+	int remainder = length % parts;
+
+	*pstart = index * size + ((index < remainder) ? index : remainder);
+	return size + (index < remainder);
+}
+
+// Parse a --pipeline: stages kernel[:R][xN] separated by commas. Stages without a radius get
+// 0, for --radius (or the size of the --kernel). Return 0 if it is malformed.
+int parse_pipeline(char *spec, input_data_t *input_data) {
+	// In the order of KERNEL_*.
+	const char *names[4] = {"gaussian", "box", "sharpen", "custom"};
+	char *stages = malloc(strlen(spec) + 1);
+	strcpy(stages, spec);
+
+	int success = 1;
+	input_data->stages = 0;
+	for(char *stage = strtok(stages, ","); stage && success; stage = strtok(NULL, ",")) {
+		if(input_data->stages == MAX_STAGES) {
+			success = 0;
+			break;
+		}
+		int s = input_data->stages++;
+		input_data->stage_radius[s] = 0;
+		input_data->stage_count[s] = 1;
+
+		// The name of the kernel, then the radius and the count.
+		char *rest = stage;
+		int kernel = -1;
+		for(int k = 0; k != 4 && kernel < 0; ++k) {
+			if(!strncmp(stage, names[k], strlen(names[k]))) {
+				kernel = k;
+				rest = stage + strlen(names[k]);
+			}
+		}
+		if(*rest == ':')
+			input_data->stage_radius[s] = (int) strtol(rest + 1, &rest, 10);
+		if(*rest == 'x')
+			input_data->stage_count[s] = (int) strtol(rest + 1, &rest, 10);
+		if(kernel < 0 || *rest != '\0' || input_data->stage_count[s] < 1)
+			success = 0;
+
+		input_data->stage_kernel[s] = kernel;
+		if(kernel == KERNEL_SHARPEN) {
+			if(input_data->stage_radius[s] > 1)
+				success = 0;
+			input_data->stage_radius[s] = 1;
+		}
+		// The --kernel has its own size.
+		if(kernel == KERNEL_CUSTOM && input_data->stage_radius[s])
+			success = 0;
+	}
+
+	free(stages);
+	return success && input_data->stages;
+}
+
+// Read the weights of a --kernel from the file 'spec' or, if there is no such file, from 'spec'
+// itself: size x size numbers (size odd, at least 3), row by row, separated by spaces, newlines
+// or commas. In a file, '#' starts a comment. Return 0 if it is malformed.
+int load_kernel(char *spec, input_data_t *input_data) {
+	char *text;
+	FILE *file = fopen(spec, "r");
+	if(file) {
+		fseek(file, 0, SEEK_END);
+		long length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		text = calloc(length + 1, sizeof(char));
+		if(fread(text, 1, length, file) != (size_t) length)
+			text[0] = '\0';
+		fclose(file);
+	} else {
+		text = malloc(strlen(spec) + 1);
+		strcpy(text, spec);
+	}
+
+	int count = 0;
+	int success = 1;
+	for(char *next = text; success; ) {
+		next += strspn(next, " \t\r\n,");
+		if(*next == '#') {
+			next += strcspn(next, "\n");
+			continue;
+		}
+		if(*next == '\0')
+			break;
+
+		char *end;
+		float weight = strtof(next, &end);
+		if(end == next || count == MAX_KERNEL_SIZE * MAX_KERNEL_SIZE)
+			success = 0;
+		else
+			input_data->kernel_weights[count++] = weight;
+		next = end;
+	}
+	free(text);
+
+	int size = 3;
+	while(size * size < count)
+		size += 2;
+	if(!success || size * size != count)
+		return 0;
+
+	input_data->kernel_size = size;
+	return 1;
+}
+
+// Normalize the weights of the --kernel as --normalize says. Return 0 if they can't be.
+// NOTE: Kernels that sum to 0, like the Laplacian or Sobel, can't be scaled to a sum of 1.
+// 'auto' leaves them as they are, so that they give 0 on flat regions (plus the --bias).
+int normalize_weights(input_data_t *input_data, int normalize) {
+	int elements = input_data->kernel_size * input_data->kernel_size;
+	float *weights = input_data->kernel_weights;
+	float sum = 0.0f;
+	float abs_sum = 0.0f;
+	for(int i = 0; i < elements; ++i) {
+		sum += weights[i];
+		abs_sum += fabsf(weights[i]);
+	}
+
+	int zero_sum = (fabsf(sum) <= ZERO_SUM_TOLERANCE * abs_sum);
+	if(normalize == NORMALIZE_OFF || (normalize == NORMALIZE_AUTO && zero_sum))
+		return 1;
+	if(zero_sum)
+		return 0;
+
+	for(int i = 0; i < elements; ++i)
+		weights[i] /= sum;
+	return 1;
+}
+
+// Iterations in one pass through the stages of the pipeline.
+int pass_iterations(input_data_t *input_data) {
+	int iterations = 0;
+	for(int s = 0; s != input_data->stages; ++s)
+		iterations += input_data->stage_count[s];
+	return iterations;
+}
+
+// Radius of the kernel of an iteration.
+int iteration_radius(input_data_t *input_data, int iteration) {
+	int i = iteration % pass_iterations(input_data);
+	int s = 0;
+	while(i >= input_data->stage_count[s])
+		i -= input_data->stage_count[s++];
+	return input_data->stage_radius[s];
+}
+
+// How wide the halos are, with an exchange every 'steps' of 'iterations': the most that the
+// iterations between two exchanges reach into them, i.e. their radii added up.
+int halo_width(input_data_t *input_data, int iterations, int steps) {
+	int width = iteration_radius(input_data, 0);
+	for(int t = 0; t < iterations; t += steps) {
+		int reach = 0;
+		for(int i = t; i < t + steps && i < iterations; ++i)
+			reach += iteration_radius(input_data, i);
+		if(reach > width)
+			width = reach;
+	}
+	return width;
+}
+
+void Print_usage(char *name) {
+	fprintf(stderr, "[%s]: Usage: %s [input_file] [width] [height] [bytes per pixel] [times] [sim_flag] [options]\n", name, name);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --radius R    Blur with a (2R+1)x(2R+1) kernel, 1 <= R <= %d (default 1)\n", MAX_KERNEL_RADIUS);
+	fprintf(stderr, "  --pipeline S    Stages kernel[:R][xN],... of gaussian, box, sharpen or custom, e.g. gaussian:2,sharpenx2 (default gaussian:R),\n");
+	fprintf(stderr, "                  applied 'times' times\n");
+	fprintf(stderr, "  --kernel K    The custom kernel, from the file K or as w,w,... (size x size weights, row by row), the default stage if given\n");
+	fprintf(stderr, "  --bias B    Added to the result of the custom kernel (default 0)\n");
+	fprintf(stderr, "  --normalize N    Scale the custom kernel to a sum of 1: on, off or auto (unless it sums to 0) (default auto)\n");
+	fprintf(stderr, "  --steps-per-exchange k    Exchange halos once every k iterations, as wide as their radii add up to (default 1)\n");
+	fprintf(stderr, "  --tile-rows H    Rows per tile when k > 1, 0 for no tiling (default: fit in L2)\n");
+	fprintf(stderr, "  --exchange X    Halo exchange: neighbor (one neighborhood collective) or p2p (default neighbor)\n");
+	fprintf(stderr, "  --halo H    Send halos as packed buffers or with derived datatypes (default packed)\n");
+	fprintf(stderr, "  --neighbors N    Exchange halos with 8 neighbors (corners included) or 4 (default 8)\n");
+	fprintf(stderr, "  --threads n    OpenMP threads per process (default OMP_NUM_THREADS)\n");
+	fprintf(stderr, "  --output FILE    Where to write the result (default test_out.raw)\n");
+	fprintf(stderr, "  --io I    Read / write the image with mpi (MPI-IO) or mmap (default mpi)\n");
+	fprintf(stderr, "  --io-hint key=value    MPI-IO hint for the image files, e.g. cb_buffer_size=16777216 (can be repeated)\n");
+	fprintf(stderr, "  --frames N    The files hold N frames of the image, one after the other (default 1)\n");
+}
+
 // Check and broadcast command line arguments
 // On success, return width divisor
 // On failure, return 0
 int Get_input(int my_rank, int comm_sz, int argc, char **argv, input_data_t *input_data) {
 	int success, width_div;
 	success = 1;
+	int normalize = NORMALIZE_AUTO;
 
 	// NOTE(stefanos): We could do more exhausting
 	// testing for the correctness of the input.
 	input_data->input_file = calloc(strlen(argv[1]) + 1, sizeof(char));
 	strcpy(input_data->input_file, argv[1]);
 	if(my_rank == 0) {
-		if(argc == 7) {
+		if(argc >= 7 && (argc - 7) % 2 == 0) {
 			input_data->width = atoi(argv[2]);
 			input_data->height = atoi(argv[3]);
 			input_data->bytes_per_pixel = atoi(argv[4]);
 			input_data->times = atoi(argv[5]);
 			// NOTE(maria): sim_flag refers to similarity check
 			input_data->sim_flag = atoi(argv[6]);
-			width_div = split_dimensions(input_data->width, input_data->height, comm_sz);
-			if(!width_div) {
-				fprintf(stderr, "[%s]: Could not split dimensions\n", argv[0]);
+			if(input_data->sim_flag < 0) {
+				fprintf(stderr, "[%s]: The iterations between convergence checks can't be negative\n", argv[0]);
+				success = 0;
+			}
+
+			// Options come in pairs after the positional arguments.
+			input_data->radius = 1;
+			input_data->stages = 0;
+			input_data->kernel_size = 0;
+			input_data->kernel_bias = 0.0f;
+			input_data->steps_per_exchange = 1;
+			input_data->tile_rows = -1;  // see main()
+			input_data->threads = 0;
+			input_data->exchange = EXCHANGE_NEIGHBOR;
+			input_data->packed_halos = 1;
+			input_data->halo_sides = 8;
+			input_data->io = IO_MPI;
+			input_data->io_hints[0] = '\0';
+			strcpy(input_data->output_file, "test_out.raw");
+			input_data->frames = 1;
+			for(int i = 7; i < argc; i += 2) {
+				if(!strcmp(argv[i], "--radius")) {
+					input_data->radius = atoi(argv[i + 1]);
+				} else if(!strcmp(argv[i], "--pipeline")) {
+					if(!parse_pipeline(argv[i + 1], input_data)) {
+						fprintf(stderr, "[%s]: Bad pipeline %s\n", argv[0], argv[i + 1]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--kernel")) {
+					if(!load_kernel(argv[i + 1], input_data)) {
+						fprintf(stderr, "[%s]: Bad kernel %s, it takes size x size weights (size odd, up to %d)\n", argv[0], argv[i + 1], MAX_KERNEL_SIZE);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--bias")) {
+					input_data->kernel_bias = strtof(argv[i + 1], NULL);
+				} else if(!strcmp(argv[i], "--normalize")) {
+					if(!strcmp(argv[i + 1], "auto")) {
+						normalize = NORMALIZE_AUTO;
+					} else if(!strcmp(argv[i + 1], "on")) {
+						normalize = NORMALIZE_ON;
+					} else if(!strcmp(argv[i + 1], "off")) {
+						normalize = NORMALIZE_OFF;
+					} else {
+						fprintf(stderr, "[%s]: Unknown normalization %s\n", argv[0], argv[i + 1]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--steps-per-exchange")) {
+					input_data->steps_per_exchange = atoi(argv[i + 1]);
+				} else if(!strcmp(argv[i], "--exchange")) {
+					if(!strcmp(argv[i + 1], "neighbor")) {
+						input_data->exchange = EXCHANGE_NEIGHBOR;
+					} else if(!strcmp(argv[i + 1], "p2p")) {
+						input_data->exchange = EXCHANGE_P2P;
+					} else {
+						fprintf(stderr, "[%s]: Unknown exchange %s\n", argv[0], argv[i + 1]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--halo")) {
+					if(!strcmp(argv[i + 1], "packed")) {
+						input_data->packed_halos = 1;
+					} else if(!strcmp(argv[i + 1], "datatype")) {
+						input_data->packed_halos = 0;
+					} else {
+						fprintf(stderr, "[%s]: Unknown halo layout %s\n", argv[0], argv[i + 1]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--neighbors")) {
+					input_data->halo_sides = atoi(argv[i + 1]);
+					if(input_data->halo_sides != 4 && input_data->halo_sides != 8) {
+						fprintf(stderr, "[%s]: Neighbors must be 4 or 8\n", argv[0]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--output")) {
+					if(strlen(argv[i + 1]) >= MAX_OUTPUT_PATH) {
+						fprintf(stderr, "[%s]: The output path is too long\n", argv[0]);
+						success = 0;
+					} else {
+						strcpy(input_data->output_file, argv[i + 1]);
+					}
+				} else if(!strcmp(argv[i], "--io")) {
+					if(!strcmp(argv[i + 1], "mpi")) {
+						input_data->io = IO_MPI;
+					} else if(!strcmp(argv[i + 1], "mmap")) {
+#ifdef HAVE_MMAP
+						input_data->io = IO_MMAP;
+#else
+						fprintf(stderr, "[%s]: mmap is not supported here\n", argv[0]);
+						success = 0;
+#endif
+					} else {
+						fprintf(stderr, "[%s]: Unknown IO %s\n", argv[0], argv[i + 1]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--io-hint")) {
+					size_t used = strlen(input_data->io_hints);
+					if(!strchr(argv[i + 1], '=') || strchr(argv[i + 1], ';')) {
+						fprintf(stderr, "[%s]: IO hints must be key=value\n", argv[0]);
+						success = 0;
+					} else if(used + strlen(argv[i + 1]) + 2 > MAX_IO_HINTS) {
+						fprintf(stderr, "[%s]: Too many IO hints\n", argv[0]);
+						success = 0;
+					} else {
+						if(used)
+							strcat(input_data->io_hints, ";");
+						strcat(input_data->io_hints, argv[i + 1]);
+					}
+				} else if(!strcmp(argv[i], "--frames")) {
+					input_data->frames = atoi(argv[i + 1]);
+					if(input_data->frames < 1) {
+						fprintf(stderr, "[%s]: There must be at least 1 frame\n", argv[0]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--threads")) {
+					input_data->threads = atoi(argv[i + 1]);
+					if(input_data->threads < 0) {
+						fprintf(stderr, "[%s]: Threads can't be negative\n", argv[0]);
+						success = 0;
+					}
+				} else if(!strcmp(argv[i], "--tile-rows")) {
+					input_data->tile_rows = atoi(argv[i + 1]);
+					if(input_data->tile_rows < 0) {
+						fprintf(stderr, "[%s]: Tile rows can't be negative\n", argv[0]);
+						success = 0;
+					}
+				} else {
+					fprintf(stderr, "[%s]: Unknown option %s\n", argv[0], argv[i]);
+					success = 0;
+				}
+			}
+
+			if(input_data->radius < 1 || input_data->radius > MAX_KERNEL_RADIUS) {
+				fprintf(stderr, "[%s]: Radius must be between 1 and %d\n", argv[0], MAX_KERNEL_RADIUS);
+				success = 0;
+			}
+
+			if(input_data->kernel_size && !normalize_weights(input_data, normalize)) {
+				fprintf(stderr, "[%s]: The kernel sums to 0, it can't be normalized\n", argv[0]);
+				success = 0;
+			}
+
+			// Without a --pipeline, the --kernel, or the blur of --radius if there is none. Stages
+			// without a radius take it too.
+			if(!input_data->stages) {
+				input_data->stages = 1;
+				input_data->stage_kernel[0] = input_data->kernel_size ? KERNEL_CUSTOM : KERNEL_GAUSSIAN;
+				input_data->stage_radius[0] = 0;
+				input_data->stage_count[0] = 1;
+			}
+			for(int s = 0; s != input_data->stages; ++s) {
+				if(input_data->stage_kernel[s] == KERNEL_CUSTOM) {
+					if(!input_data->kernel_size) {
+						fprintf(stderr, "[%s]: Stage %d is custom, but there is no --kernel\n", argv[0], s + 1);
+						success = 0;
+					}
+					input_data->stage_radius[s] = input_data->kernel_size / 2;
+				}
+				if(!input_data->stage_radius[s])
+					input_data->stage_radius[s] = input_data->radius;
+				if(input_data->stage_radius[s] < 1 || input_data->stage_radius[s] > MAX_KERNEL_RADIUS) {
+					fprintf(stderr, "[%s]: The radius of stage %d must be between 1 and %d\n", argv[0], s + 1, MAX_KERNEL_RADIUS);
+					success = 0;
+				}
+			}
+
+			if(input_data->steps_per_exchange < 1) {
+				fprintf(stderr, "[%s]: Steps per exchange must be at least 1\n", argv[0]);
+				success = 0;
+			}
+
+			if(input_data->frames > 1 && input_data->io == IO_MMAP) {
+				fprintf(stderr, "[%s]: Frames are only read / written with MPI-IO\n", argv[0]);
 				success = 0;
 			}
+
+			// NOTE: A temporary file of this job, so that jobs that write the same output don't
+			// write into each other's.
+#ifdef HAVE_MMAP
+			sprintf(input_data->temp_file, "%s.%ld.tmp", input_data->output_file, (long) getpid());
+#else
+			sprintf(input_data->temp_file, "%s.tmp", input_data->output_file);
+#endif
+
+			if(success) {
+				// Halos are that wide, see main().
+				int halo = halo_width(input_data, input_data->times * pass_iterations(input_data), input_data->steps_per_exchange);
+				width_div = split_dimensions(input_data->width, input_data->height, comm_sz);
+				if(!width_div) {
+					fprintf(stderr, "[%s]: Could not split dimensions\n", argv[0]);
+					success = 0;
+				} else if(input_data->width / width_div < halo ||
+					input_data->height / (comm_sz / width_div) < halo) {
+					// Every neighbor needs halo rows / columns from us (the smallest blocks have that many).
+					fprintf(stderr, "[%s]: Each process needs at least %d rows and columns\n", argv[0], halo);
+					success = 0;
+				}
+			}
 		} else {
 			if(my_rank == 0)
-				fprintf(stderr, "[%s]: Usage: %s [input_file] [width] [height] [bytes per pixel] [times] [sim_flag]\n", argv[0], argv[0]);
+				Print_usage(argv[0]);
 			success = 0;
 		}
 	}
@@ -115,6 +591,25 @@ int Get_input(int my_rank, int comm_sz, int argc, char **argv, input_data_t *inp
 		MPI_Bcast(&(input_data->bytes_per_pixel), 1, MPI_INT, 0, MPI_COMM_WORLD);
 		MPI_Bcast(&(input_data->times), 1, MPI_INT, 0, MPI_COMM_WORLD);
 		MPI_Bcast(&(input_data->sim_flag), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->radius), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->stages), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(input_data->stage_kernel, MAX_STAGES, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(input_data->stage_radius, MAX_STAGES, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(input_data->stage_count, MAX_STAGES, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->kernel_size), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(input_data->kernel_weights, MAX_KERNEL_SIZE * MAX_KERNEL_SIZE, MPI_FLOAT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->kernel_bias), 1, MPI_FLOAT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->steps_per_exchange), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->tile_rows), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->threads), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->exchange), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->packed_halos), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->halo_sides), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->io), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(&(input_data->frames), 1, MPI_INT, 0, MPI_COMM_WORLD);
+		MPI_Bcast(input_data->io_hints, MAX_IO_HINTS, MPI_CHAR, 0, MPI_COMM_WORLD);
+		MPI_Bcast(input_data->output_file, MAX_OUTPUT_PATH, MPI_CHAR, 0, MPI_COMM_WORLD);
+		MPI_Bcast(input_data->temp_file, MAX_OUTPUT_PATH + 32, MPI_CHAR, 0, MPI_COMM_WORLD);
 
 		return width_div;
 	}
@@ -122,170 +617,1043 @@ int Get_input(int my_rank, int comm_sz, int argc, char **argv, input_data_t *inp
 	return 0;
 }
 
-///        PARALLEL I/O        ///
+///        HALO EXCHANGE        ///
+
+// Neighbors. The first 4 are in the order of the cartesian topology: dimension 0 (rows)
+// then 1 (columns), the negative direction first. The diagonal ones follow.
+enum {
+	HALO_TOP,
+	HALO_BOTTOM,
+	HALO_LEFT,
+	HALO_RIGHT,
+	HALO_TOP_LEFT,
+	HALO_TOP_RIGHT,
+	HALO_BOTTOM_LEFT,
+	HALO_BOTTOM_RIGHT
+};
+
+// A bit (1 << side) for every side.
+#define HALO_ALL_SIDES 0xff
+
+typedef struct halo {
+	MPI_Comm comm;
+	int mode;
+	// 8 to also exchange the corners with the diagonal neighbors, 4 otherwise.
+	int sides;
+	// MPI_PROC_NULL if there's no neighbor on that side.
+	int neighbors[8];
+	// What is sent to / received from each side, in every color: 'rows' x 'cols'
+	// starting at send_row, send_col / recv_row, recv_col of the padded plane.
+	int send_row[8];
+	int send_col[8];
+	int recv_row[8];
+	int recv_col[8];
+	int rows[8];
+	int cols[8];
+	int counts[8];
+	MPI_Datatype types[8];
+	// Byte offsets from the start of the color planes, or of send_buf / recv_buf if packed.
+	MPI_Aint send_displs[8];
+	MPI_Aint recv_displs[8];
+	// NOTE: The exchange alternates between the two arrays of color planes, so there is a set of
+	// persistent requests for each one. For p2p, the receives come first, then the sends.
+	uint8_t *data[2];
+	MPI_Request requests[2][16];
+	// Set of the exchange in progress.
+	int active;
+	// Sides whose halos are in place, a bit (1 << side) per side. Sides that aren't
+	// exchanged count as arrived.
+	int arrived;
+
+	// For the neighborhood collective: a communicator with just the neighbors that exist
+	// and the arguments for them.
+	MPI_Comm graph_comm;
+	int graph_size;
+	int graph_counts[8];
+	MPI_Datatype graph_types[8];
+	MPI_Aint graph_send_displs[8];
+	MPI_Aint graph_recv_displs[8];
+
+	// If packed, the halos are copied to / from contiguous buffers and sent as bytes,
+	// instead of being sent from the color planes with derived datatypes.
+	int packed;
+	uint8_t *send_buf;
+	uint8_t *recv_buf;
+	// Geometry of the color planes, to pack them.
+	int bytes_per_pixel;
+	int padded_rows;
+	int padded_cols;
+	size_t elem_size;
+} halo_t;
+
+// Copy the 'rows' x 'cols' rectangle at 'row', 'col' of every color to a contiguous buffer, row by row.
+void pack_block(halo_t *halo, uint8_t *planes, int row, int col, int rows, int cols, uint8_t *buf) {
+	size_t row_bytes = halo->padded_cols * halo->elem_size;
+	size_t plane_bytes = halo->padded_rows * row_bytes;
+	size_t block_row_bytes = cols * halo->elem_size;
+	for(int color = 0; color != halo->bytes_per_pixel; ++color) {
+		uint8_t *in = planes + color * plane_bytes + row * row_bytes + col * halo->elem_size;
+		for(int r = 0; r != rows; ++r) {
+			memcpy(buf, in, block_row_bytes);
+			buf += block_row_bytes;
+			in += row_bytes;
+		}
+	}
+}
+
+void unpack_block(halo_t *halo, uint8_t *buf, uint8_t *planes, int row, int col, int rows, int cols) {
+	size_t row_bytes = halo->padded_cols * halo->elem_size;
+	size_t plane_bytes = halo->padded_rows * row_bytes;
+	size_t block_row_bytes = cols * halo->elem_size;
+	for(int color = 0; color != halo->bytes_per_pixel; ++color) {
+		uint8_t *out = planes + color * plane_bytes + row * row_bytes + col * halo->elem_size;
+		for(int r = 0; r != rows; ++r) {
+			memcpy(out, buf, block_row_bytes);
+			buf += block_row_bytes;
+			out += row_bytes;
+		}
+	}
+}
+
+// Same as pack_block() but column by column, for the narrow left / right halos.
+void pack_columns(halo_t *halo, uint8_t *planes, int row, int col, int rows, int cols, uint8_t *buf) {
+	int stride = halo->padded_cols;
+	for(int color = 0; color != halo->bytes_per_pixel; ++color) {
+		int first = color * halo->padded_rows + row;
+		for(int c = 0; c != cols; ++c) {
+			uint8_t *in = planes + (size_t) first * stride + col + c;
+			for(int r = 0; r != rows; ++r)
+				*buf++ = in[(size_t) r * stride];
+		}
+	}
+}
+
+void unpack_columns(halo_t *halo, uint8_t *buf, uint8_t *planes, int row, int col, int rows, int cols) {
+	int stride = halo->padded_cols;
+	for(int color = 0; color != halo->bytes_per_pixel; ++color) {
+		int first = color * halo->padded_rows + row;
+		for(int c = 0; c != cols; ++c) {
+			uint8_t *out = planes + (size_t) first * stride + col + c;
+			for(int r = 0; r != rows; ++r)
+				out[(size_t) r * stride] = *buf++;
+		}
+	}
+}
 
-void Read_data(image_info_t *image_info, input_data_t *input_data, int start_row, int start_col, uint8_t *out) {
-	// decouple struct data
+// Set up the exchange of the halos of the color planes in data[0] and data[1].
+void Halo_init(halo_t *halo, MPI_Comm cart_comm, image_info_t *image_info, size_t elem_size, MPI_Datatype elem_type, int mode, int packed, int sides, uint8_t *data[2]) {
+	int bytes_per_pixel = image_info->bytes_per_pixel;
 	int cols = image_info->cols;
 	int rows = image_info->rows;
-	int bytes_per_pixel = image_info->bytes_per_pixel;
+	int pad = image_info->padding;
+	int padded_cols = cols + 2 * pad;
+	int padded_rows = rows + 2 * pad;
+
+	halo->comm = cart_comm;
+	halo->mode = mode;
+	halo->sides = sides;
+	halo->packed = packed;
+	halo->bytes_per_pixel = bytes_per_pixel;
+	halo->padded_rows = padded_rows;
+	halo->padded_cols = padded_cols;
+	halo->elem_size = elem_size;
+
+	MPI_Cart_shift(cart_comm, 0, 1, &halo->neighbors[HALO_TOP], &halo->neighbors[HALO_BOTTOM]);
+	MPI_Cart_shift(cart_comm, 1, 1, &halo->neighbors[HALO_LEFT], &halo->neighbors[HALO_RIGHT]);
+
+	// The diagonal neighbors exist if both of the neighbors next to them exist.
+	int rank, coords[2], dims[2], periods[2];
+	MPI_Comm_rank(cart_comm, &rank);
+	MPI_Cart_get(cart_comm, 2, dims, periods, coords);
+	for(int side = HALO_TOP_LEFT; side <= HALO_BOTTOM_RIGHT; ++side) {
+		int vertical = (side == HALO_TOP_LEFT || side == HALO_TOP_RIGHT) ? HALO_TOP : HALO_BOTTOM;
+		int horizontal = (side == HALO_TOP_LEFT || side == HALO_BOTTOM_LEFT) ? HALO_LEFT : HALO_RIGHT;
+		halo->neighbors[side] = MPI_PROC_NULL;
+		if(halo->neighbors[vertical] != MPI_PROC_NULL && halo->neighbors[horizontal] != MPI_PROC_NULL) {
+			int diagonal[2];
+			diagonal[0] = coords[0] + ((vertical == HALO_TOP) ? -1 : 1);
+			diagonal[1] = coords[1] + ((horizontal == HALO_LEFT) ? -1 : 1);
+			MPI_Cart_rank(cart_comm, diagonal, &halo->neighbors[side]);
+		}
+	}
 
-	char *input_file = input_data->input_file;
-	int width = input_data->width;
+	// Where the halos are. The columns cover only the valid rows, the corners come
+	// from the diagonal neighbors.
+	for(int side = 0; side != 8; ++side) {
+		int top = (side == HALO_TOP || side == HALO_TOP_LEFT || side == HALO_TOP_RIGHT);
+		int bottom = (side == HALO_BOTTOM || side == HALO_BOTTOM_LEFT || side == HALO_BOTTOM_RIGHT);
+		int left = (side == HALO_LEFT || side == HALO_TOP_LEFT || side == HALO_BOTTOM_LEFT);
+		int right = (side == HALO_RIGHT || side == HALO_TOP_RIGHT || side == HALO_BOTTOM_RIGHT);
+
+		halo->rows[side] = (top || bottom) ? pad : rows;
+		halo->cols[side] = (left || right) ? pad : cols;
+		halo->send_row[side] = bottom ? rows : pad;
+		halo->recv_row[side] = top ? 0 : (bottom ? rows + pad : pad);
+		halo->send_col[side] = right ? cols : pad;
+		halo->recv_col[side] = left ? 0 : (right ? cols + pad : pad);
+	}
 
-	MPI_File in_file_handle;
-	MPI_File_open(MPI_COMM_WORLD, input_file, MPI_MODE_RDONLY, MPI_INFO_NULL, &in_file_handle);
+	if(packed) {
+		// One section per side, each aligned to 32 bytes.
+		MPI_Aint offset = 0;
+		for(int side = 0; side != 8; ++side) {
+			MPI_Aint bytes = (MPI_Aint) bytes_per_pixel * halo->rows[side] * halo->cols[side] * elem_size;
+			// NOTE: The counts of MPI are ints, so a side can't be 2 GiB or more. Only a block
+			// with a side of hundreds of millions of pixels gets there.
+			if(bytes > INT_MAX) {
+				fprintf(stderr, "The halo of a block is too large (%lld bytes)\n", (long long) bytes);
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+			halo->counts[side] = (int) bytes;
+			halo->types[side] = MPI_BYTE;
+			halo->send_displs[side] = halo->recv_displs[side] = offset;
+			offset += (bytes + 31) / 32 * 32;
+		}
+		halo->send_buf = malloc(offset);
+		halo->recv_buf = malloc(offset);
+	} else {
+		for(int side = 0; side != 8; ++side) {
+			MPI_Datatype plane_type;
+			// Type to send the rectangle of one color.
+			MPI_Type_vector(halo->rows[side], halo->cols[side], padded_cols, elem_type, &plane_type);
+			// Type to send bytes_per_pixel of those, each of whome is 1 color's bytes worth (including the padding) apart.
+			MPI_Type_create_hvector(bytes_per_pixel, 1, (MPI_Aint) padded_rows * padded_cols * elem_size, plane_type, &halo->types[side]);
+			MPI_Type_commit(&halo->types[side]);
+			MPI_Type_free(&plane_type);
+
+			halo->counts[side] = 1;
+			halo->send_displs[side] = ((MPI_Aint) halo->send_row[side] * padded_cols + halo->send_col[side]) * elem_size;
+			halo->recv_displs[side] = ((MPI_Aint) halo->recv_row[side] * padded_cols + halo->recv_col[side]) * elem_size;
+		}
+	}
+
+	if(mode == EXCHANGE_NEIGHBOR) {
+		// NOTE: The cartesian topology only has the 4 neighbors and MPI_PROC_NULL can't be a
+		// neighbor of a distributed graph, so make one with the neighbors that exist.
+		int graph_neighbors[8], graph_weights[8];
+		halo->graph_size = 0;
+		for(int side = 0; side != sides; ++side) {
+			if(halo->neighbors[side] == MPI_PROC_NULL)
+				continue;
+			int i = halo->graph_size++;
+			graph_neighbors[i] = halo->neighbors[side];
+			graph_weights[i] = 1;
+			halo->graph_counts[i] = halo->counts[side];
+			halo->graph_types[i] = halo->types[side];
+			halo->graph_send_displs[i] = halo->send_displs[side];
+			halo->graph_recv_displs[i] = halo->recv_displs[side];
+		}
+		MPI_Dist_graph_create_adjacent(cart_comm, halo->graph_size, graph_neighbors, graph_weights,
+			halo->graph_size, graph_neighbors, graph_weights, MPI_INFO_NULL, 0, &halo->graph_comm);
+	}
+
+	for(int set = 0; set != 2; ++set) {
+		halo->data[set] = data[set];
+		// NOTE: When packed, both sets use the same buffers.
+		uint8_t *send_base = packed ? halo->send_buf : data[set];
+		uint8_t *recv_base = packed ? halo->recv_buf : data[set];
+		if(mode == EXCHANGE_NEIGHBOR) {
+#if MPI_VERSION >= 4
+			MPI_Neighbor_alltoallw_init(send_base, halo->graph_counts, halo->graph_send_displs, halo->graph_types,
+				recv_base, halo->graph_counts, halo->graph_recv_displs, halo->graph_types, halo->graph_comm, MPI_INFO_NULL, &halo->requests[set][0]);
+#endif
+		} else {
+			for(int side = 0; side != sides; ++side) {
+				MPI_Recv_init(recv_base + halo->recv_displs[side], halo->counts[side], halo->types[side], halo->neighbors[side], 0, cart_comm, &halo->requests[set][side]);
+				MPI_Send_init(send_base + halo->send_displs[side], halo->counts[side], halo->types[side], halo->neighbors[side], 0, cart_comm, &halo->requests[set][sides + side]);
+			}
+		}
+	}
+}
 
-	int read_pos;
-	size_t size_of_one_line = cols * bytes_per_pixel;
-	uint8_t *line_buffer = malloc(size_of_one_line * sizeof(uint8_t));
-	for(int row = 0; row != rows; ++row) {
-		int row_pos = (start_row + row) * width;
-		read_pos = (row_pos + start_col) * bytes_per_pixel;
-		MPI_File_seek(in_file_handle, read_pos, MPI_SEEK_SET);
+// Start exchanging the halos of the color planes in 'data' (one of those given to Halo_init()).
+void Halo_start(halo_t *halo, uint8_t *data) {
+	int set = (data == halo->data[0]) ? 0 : 1;
+	halo->active = set;
+	halo->arrived = 0;
+	for(int side = 0; side != 8; ++side) {
+		if(side >= halo->sides || halo->neighbors[side] == MPI_PROC_NULL)
+			halo->arrived |= 1 << side;
+	}
 
-		// read bytes
-		MPI_File_read(in_file_handle, line_buffer, size_of_one_line, MPI_BYTE, MPI_STATUS_IGNORE);
-		for(int i = 0; i != size_of_one_line; ++i)
-			*out++ = (uint8_t) line_buffer[i];
+	if(halo->packed) {
+		for(int side = 0; side != halo->sides; ++side) {
+			if(halo->neighbors[side] == MPI_PROC_NULL)
+				continue;
+			if(side == HALO_LEFT || side == HALO_RIGHT)
+				pack_columns(halo, data, halo->send_row[side], halo->send_col[side], halo->rows[side], halo->cols[side], halo->send_buf + halo->send_displs[side]);
+			else
+				pack_block(halo, data, halo->send_row[side], halo->send_col[side], halo->rows[side], halo->cols[side], halo->send_buf + halo->send_displs[side]);
+		}
 	}
 
-	free(line_buffer);
+	if(halo->mode == EXCHANGE_NEIGHBOR) {
+#if MPI_VERSION >= 4
+		MPI_Start(&halo->requests[set][0]);
+#else
+		// No persistent neighborhood collectives before MPI 4.
+		uint8_t *send_base = halo->packed ? halo->send_buf : data;
+		uint8_t *recv_base = halo->packed ? halo->recv_buf : data;
+		MPI_Ineighbor_alltoallw(send_base, halo->graph_counts, halo->graph_send_displs, halo->graph_types,
+			recv_base, halo->graph_counts, halo->graph_recv_displs, halo->graph_types, halo->graph_comm, &halo->requests[set][0]);
+#endif
+		return;
+	}
 
-	MPI_File_close(&in_file_handle);
+	MPI_Startall(2 * halo->sides, halo->requests[set]);
 }
 
-void Write_data(int my_rank, image_info_t *image_info, input_data_t *input_data, int start_row, int start_col, uint8_t *in) {
-	// decouple struct data
-	int cols = image_info->cols;
-	int rows = image_info->rows;
-	int bytes_per_pixel = image_info->bytes_per_pixel;
-	int width = input_data->width;
+// Sides whose halos the rows first_row..last_row and columns first_col..last_col of a
+// color plane overlap, a bit (1 << side) per side. Only sides with a neighbor count.
+int Halo_needs(halo_t *halo, int first_row, int last_row, int first_col, int last_col) {
+	int needs = 0;
+	for(int side = 0; side != halo->sides; ++side) {
+		if(halo->neighbors[side] == MPI_PROC_NULL)
+			continue;
+		if(first_row < halo->recv_row[side] + halo->rows[side] && last_row >= halo->recv_row[side] &&
+			first_col < halo->recv_col[side] + halo->cols[side] && last_col >= halo->recv_col[side])
+			needs |= 1 << side;
+	}
+	return needs;
+}
 
-	char out_image[64];
-	strcpy(out_image, "test_out.raw");
+// Complete (and unpack) the halos that have arrived. If 'wait', block until at least one more
+// has, unless all have. Return the sides whose halos are in place, see halo_t::arrived.
+// NOTE: Calling it without waiting also gives MPI implementations without a progress
+// thread the chance to move the exchange forward.
+int Halo_progress(halo_t *halo, int wait) {
+	if(halo->arrived == HALO_ALL_SIDES)
+		return halo->arrived;
+
+	int done[8];
+	int count = 0;
+	if(halo->mode == EXCHANGE_NEIGHBOR) {
+		// All the halos arrive at once.
+		int flag = 1;
+		if(wait)
+			MPI_Wait(&halo->requests[halo->active][0], MPI_STATUS_IGNORE);
+		else
+			MPI_Test(&halo->requests[halo->active][0], &flag, MPI_STATUS_IGNORE);
+		if(flag) {
+			for(int side = 0; side != 8; ++side) {
+				if(!(halo->arrived & (1 << side)))
+					done[count++] = side;
+			}
+		}
+	} else {
+		if(wait)
+			MPI_Waitsome(halo->sides, halo->requests[halo->active], &count, done, MPI_STATUSES_IGNORE);
+		else
+			MPI_Testsome(halo->sides, halo->requests[halo->active], &count, done, MPI_STATUSES_IGNORE);
+		if(count == MPI_UNDEFINED)
+			count = 0;
+	}
 
-	MPI_File out_file_handle;
-	MPI_File_open(MPI_COMM_WORLD, out_image, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &out_file_handle);
+	for(int i = 0; i != count; ++i) {
+		int side = done[i];
+		if(halo->packed && !(halo->arrived & (1 << side))) {
+			uint8_t *data = halo->data[halo->active];
+			if(side == HALO_LEFT || side == HALO_RIGHT)
+				unpack_columns(halo, halo->recv_buf + halo->recv_displs[side], data, halo->recv_row[side], halo->recv_col[side], halo->rows[side], halo->cols[side]);
+			else
+				unpack_block(halo, halo->recv_buf + halo->recv_displs[side], data, halo->recv_row[side], halo->recv_col[side], halo->rows[side], halo->cols[side]);
+		}
+		halo->arrived |= 1 << side;
+	}
 
-	int write_pos;
-	size_t size_of_one_line = cols * bytes_per_pixel;
-	uint8_t *line_buffer = malloc(size_of_one_line * sizeof(uint8_t));
-	for(int row = 0; row != rows; ++row) {
-		int row_pos = (start_row + row) * width;
-		write_pos = (row_pos + start_col) * bytes_per_pixel;
-		MPI_File_seek(out_file_handle, write_pos, MPI_SEEK_SET);
+	return halo->arrived;
+}
 
-		for(int i = 0; i != size_of_one_line; ++i)
-			line_buffer[i] = (uint8_t) *in++;
+// Wait until the exchange is over and the sent data can be overwritten.
+void Halo_wait_send(halo_t *halo) {
+	while(Halo_progress(halo, 1) != HALO_ALL_SIDES)
+		;
+	// NOTE: The collective has already completed in Halo_progress(). For p2p, this also
+	// completes the receives from MPI_PROC_NULL, so that all the requests can be started again.
+	if(halo->mode == EXCHANGE_P2P)
+		MPI_Waitall(2 * halo->sides, halo->requests[halo->active], MPI_STATUSES_IGNORE);
+}
 
-		// write bytes
-		MPI_File_write(out_file_handle, line_buffer, size_of_one_line, MPI_BYTE, MPI_STATUS_IGNORE);
+void Halo_free(halo_t *halo) {
+	for(int set = 0; set != 2; ++set) {
+		if(halo->mode == EXCHANGE_P2P) {
+			for(int i = 0; i != 2 * halo->sides; ++i)
+				MPI_Request_free(&halo->requests[set][i]);
+		}
+#if MPI_VERSION >= 4
+		else {
+			MPI_Request_free(&halo->requests[set][0]);
+		}
+#endif
 	}
 
-	free(line_buffer);
+	if(halo->mode == EXCHANGE_NEIGHBOR)
+		MPI_Comm_free(&halo->graph_comm);
 
-	MPI_File_close(&out_file_handle);
+	if(halo->packed) {
+		free(halo->send_buf);
+		free(halo->recv_buf);
+	} else {
+		for(int side = 0; side != 8; ++side)
+			MPI_Type_free(&halo->types[side]);
+	}
+}
+
+///        MEMORY        ///
+
+// Allocate zeroed color planes. Each thread touches first the rows that it will compute,
+// so that, on NUMA machines, their pages are placed near it.
+uint8_t *Alloc_planes(int planes, int padded_rows, size_t row_bytes, long int avail_threads) {
+	uint8_t *data = malloc((size_t) planes * padded_rows * row_bytes);
+	for(int plane = 0; plane != planes; ++plane) {
+		uint8_t *plane_data = data + (size_t) plane * padded_rows * row_bytes;
+#ifdef _OPENMP
+		#pragma omp parallel for num_threads(avail_threads) schedule(static)
+#endif
+		for(int row = 0; row < padded_rows; ++row)
+			memset(plane_data + row * row_bytes, 0, row_bytes);
+	}
+	return data;
 }
 
 ///        COLOR MANIPULATION        ///
 
-void Split_colors(image_info_t *image_info, uint8_t *in, uint8_t *out) {
-	int rows = image_info->rows;
+// Split 'count' rows of the block, starting at 'first_row', so that bytes of the same color
+// are packed together (So, first the bytes of red, then green and so on...), in their padded planes.
+void Split_colors(image_info_t *image_info, uint8_t *in, int first_row, int count, uint8_t *out) {
 	int stride = image_info->cols;
 	int bytes_per_pixel = image_info->bytes_per_pixel;
+	int padding = image_info->padding;
+	int padded_stride = stride + 2 * padding;
+	size_t plane_size = (size_t) (image_info->rows + 2 * padding) * padded_stride;
 
 	uint8_t *reader;
-	// skip the first padding line
-	out += stride + 2;
+	uint8_t *writer;
 	// For every color
 	for(int color = 0; color != bytes_per_pixel; ++color) {
 		reader = in + color;  // start at the ith (1,2,3,4) byte of the first pixel
+		// skip the padding lines and the rows before first_row
+		writer = out + color * plane_size + (size_t) (padding + first_row) * padded_stride;
 		// for every row
-		for(int row = 0; row != rows; ++row) {
-			++out;  // skip one padding pixel
+		for(int row = 0; row != count; ++row) {
+			writer += padding;  // skip the left padding pixels
 			// NOTE(stefanos): For each color, each of its bytes is bytes_per_pixel
 			// apart from the next.
 			for(int col = 0; col != stride; ++col) {
-				*out++ = *reader;
+				*writer++ = *reader;
 				reader += bytes_per_pixel;
 			}
-			++out;  // skip one padding pixel
+			writer += padding;  // skip the right padding pixels
 		}
-		// skip 2 intermediate padding lines
-		out += 2 * (stride + 2);
 	}
 }
 
-void Recombine_colors(image_info_t *image_info, uint8_t *in, uint8_t *out) {
-	int rows = image_info->rows;
+void Recombine_colors(image_info_t *image_info, uint8_t *in, int first_row, int count, uint8_t *out) {
 	int stride = image_info->cols;
 	int bytes_per_pixel = image_info->bytes_per_pixel;
+	int padding = image_info->padding;
+	int padded_stride = stride + 2 * padding;
+	size_t plane_size = (size_t) (image_info->rows + 2 * padding) * padded_stride;
 
+	uint8_t *reader;
 	uint8_t *writer;
-	// skip the first padding line
-	in += stride + 2;
 	for(int color = 0; color != bytes_per_pixel; ++color) {
+		reader = in + color * plane_size + (size_t) (padding + first_row) * padded_stride;
 		writer = out + color;
-		for(int row = 0; row != rows; ++row) {
-			++in;  // skip one padding pixel
+		for(int row = 0; row != count; ++row) {
+			reader += padding;  // skip the left padding pixels
 			// NOTE(stefanos): For each color, each of its bytes is bytes_per_pixel
 			// apart from the next.
 			for(int col = 0; col != stride; ++col) {
-				*writer = *in++;
+				*writer = *reader++;
 				writer += bytes_per_pixel;
 			}
-			++in;  // skip one padding pixel
+			reader += padding;  // skip the right padding pixels
 		}
-		// skip 2 intermediate padding lines
-		in += 2 * (stride + 2);
 	}
 }
 
-// NOTE(maria): If at least 1 pixel is diff
-// we do not need to check again
-int Check_similarity(uint8_t *cache_in, uint8_t *cache_out, int pos){
-    if (cache_in[pos] != cache_out[pos])
-        return 1;
-    return 0;
+///        PARALLEL I/O        ///
+
+// MPI_Info with the --io-hint hints, or MPI_INFO_NULL if there are none.
+MPI_Info Io_hints(input_data_t *input_data) {
+	if(!input_data->io_hints[0])
+		return MPI_INFO_NULL;
+
+	MPI_Info info;
+	MPI_Info_create(&info);
+
+	char hints[MAX_IO_HINTS];
+	strcpy(hints, input_data->io_hints);
+	for(char *hint = strtok(hints, ";"); hint; hint = strtok(NULL, ";")) {
+		char *value = strchr(hint, '=');
+		*value++ = '\0';
+		MPI_Info_set(info, hint, value);
+	}
+
+	return info;
+}
+
+// Make the view of the file this process's block of pixels, so that it can be read / written
+// with collective calls. The type of a row of the block is returned in *prow_type.
+// NOTE: The file is accessed in rows, not pixels, so that the count fits in an int even for
+// blocks of more than 2^31 pixels. MPI computes the offsets in the file, in 64 bits.
+void Set_block_view(MPI_File file_handle, image_info_t *image_info, input_data_t *input_data, int start_row, int start_col, MPI_Datatype *prow_type) {
+	MPI_Datatype pixel_type;
+	MPI_Datatype row_type;
+	MPI_Datatype block_type;
+	int sizes[2] = {input_data->height, input_data->width};
+	int subsizes[2] = {image_info->rows, image_info->cols};
+	int starts[2] = {start_row, start_col};
+
+	MPI_Type_contiguous(image_info->bytes_per_pixel, MPI_BYTE, &pixel_type);
+	MPI_Type_commit(&pixel_type);
+	MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, pixel_type, &block_type);
+	MPI_Type_commit(&block_type);
+
+	MPI_File_set_view(file_handle, 0, pixel_type, block_type, "native", MPI_INFO_NULL);
+
+	MPI_Type_contiguous(image_info->cols, pixel_type, &row_type);
+	MPI_Type_commit(&row_type);
+
+	MPI_Type_free(&block_type);
+	MPI_Type_free(&pixel_type);
+	*prow_type = row_type;
+}
+
+// Rows of the block per chunk of Read_data() / Write_data(). In *pchunks, how many chunks every
+// process goes through: the most that any process needs, as the reads / writes are collective.
+int Io_chunk_rows(image_info_t *image_info, int *pchunks) {
+	size_t row_bytes = (size_t) image_info->cols * image_info->bytes_per_pixel;
+	int chunk_rows = (row_bytes < IO_CHUNK_BYTES) ? (int) (IO_CHUNK_BYTES / row_bytes) : 1;
+	if(chunk_rows > image_info->rows)
+		chunk_rows = image_info->rows;
+
+	int chunks = (image_info->rows + chunk_rows - 1) / chunk_rows;
+	MPI_Allreduce(MPI_IN_PLACE, &chunks, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+	*pchunks = chunks;
+	return chunk_rows;
+}
+
+#ifdef HAVE_MMAP
+
+// Map the bytes first..first + length - 1 of a file, to read them or, if 'writable', to write them
+// to the file. Return where they start. *pmapping and *pmapping_length are what to munmap(), from
+// the page that the bytes start in.
+uint8_t *Map_file(char *file_name, int writable, size_t first, size_t length, void **pmapping, size_t *pmapping_length) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t start = first / page * page;
+	size_t mapping_length = first + length - start;
+	void *mapping = MAP_FAILED;
+	int fd = open(file_name, writable ? O_RDWR : O_RDONLY);
+	if(fd >= 0) {
+		mapping = mmap(NULL, mapping_length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, (off_t) start);
+		close(fd);
+	}
+	if(mapping == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s: %s\n", file_name, strerror(errno));
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	// The rows are gone through once, in order. Huge pages, if the file system has them
+	// for files, mean fewer page faults and TLB misses. Either is just a hint.
+	madvise(mapping, mapping_length, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(mapping, mapping_length, MADV_HUGEPAGE);
+#endif
+
+	*pmapping = mapping;
+	*pmapping_length = mapping_length;
+	return (uint8_t *) mapping + (first - start);
+}
+
+// Read_data() with mmap: the rows of the block are split straight from the mapping of the file,
+// without a copy and without MPI-IO.
+void Read_data_mmap(image_info_t *image_info, input_data_t *input_data, int start_row, int start_col, uint8_t *planes) {
+	size_t pixel_size = image_info->bytes_per_pixel;
+	size_t file_row_bytes = (size_t) input_data->width * pixel_size;
+	size_t first = (size_t) start_row * file_row_bytes + start_col * pixel_size;
+	size_t length = (size_t) (image_info->rows - 1) * file_row_bytes + image_info->cols * pixel_size;
+
+	void *mapping;
+	size_t mapping_length;
+	uint8_t *block = Map_file(input_data->input_file, 0, first, length, &mapping, &mapping_length);
+	for(int row = 0; row != image_info->rows; ++row)
+		Split_colors(image_info, block + row * file_row_bytes, row, 1, planes);
+	munmap(mapping, mapping_length);
+}
+
+// Write_data() with mmap. The file already has its size, see Create_output().
+void Write_data_mmap(image_info_t *image_info, input_data_t *input_data, int start_row, int start_col, uint8_t *planes) {
+	size_t pixel_size = image_info->bytes_per_pixel;
+	size_t file_row_bytes = (size_t) input_data->width * pixel_size;
+	size_t first = (size_t) start_row * file_row_bytes + start_col * pixel_size;
+	size_t length = (size_t) (image_info->rows - 1) * file_row_bytes + image_info->cols * pixel_size;
+	void *mapping;
+	size_t mapping_length;
+	uint8_t *block = Map_file(input_data->temp_file, 1, first, length, &mapping, &mapping_length);
+	for(int row = 0; row != image_info->rows; ++row)
+		Recombine_colors(image_info, planes, row, 1, block + row * file_row_bytes);
+	// NOTE: The pages are shared with the file, they reach it (or whoever reads it) after this.
+	munmap(mapping, mapping_length);
+}
+
+#endif
+
+// Create the file that Write_data() writes to, input_data->temp_file, with the size of the image
+// (all its frames) and its blocks allocated, so that the timed write doesn't pay for them.
+void Create_output(int my_rank, input_data_t *input_data) {
+	MPI_Offset size = (MPI_Offset) input_data->frames * input_data->height * input_data->width * input_data->bytes_per_pixel;
+	MPI_Info info = Io_hints(input_data);
+	MPI_File out_file_handle;
+	if(MPI_File_open(MPI_COMM_WORLD, input_data->temp_file, MPI_MODE_CREATE | MPI_MODE_WRONLY, info, &out_file_handle) != MPI_SUCCESS) {
+		if(my_rank == 0)
+			fprintf(stderr, "Could not create %s\n", input_data->temp_file);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+	MPI_File_set_size(out_file_handle, size);
+	MPI_File_preallocate(out_file_handle, size);
+	MPI_File_close(&out_file_handle);
+	if(info != MPI_INFO_NULL)
+		MPI_Info_free(&info);
+}
+
+// Once every process has written its block, replace the output with the complete image,
+// so that it is never a partial one.
+void Rename_output(int my_rank, input_data_t *input_data) {
+	MPI_Barrier(MPI_COMM_WORLD);
+	if(my_rank == 0 && rename(input_data->temp_file, input_data->output_file) != 0) {
+		fprintf(stderr, "Could not rename %s to %s\n", input_data->temp_file, input_data->output_file);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+}
+
+// Read the block of this process straight into the padded color planes.
+void Read_data(image_info_t *image_info, input_data_t *input_data, int start_row, int start_col, uint8_t *planes) {
+#ifdef HAVE_MMAP
+	if(input_data->io == IO_MMAP) {
+		Read_data_mmap(image_info, input_data, start_row, start_col, planes);
+		return;
+	}
+#endif
+
+	MPI_Info info = Io_hints(input_data);
+	MPI_File in_file_handle;
+	MPI_File_open(MPI_COMM_WORLD, input_data->input_file, MPI_MODE_RDONLY, info, &in_file_handle);
+
+	// NOTE: Collective reads of the block instead of a seek and a read per row, so that MPI-IO
+	// can merge the rows of all the processes into a few large requests. They are done in chunks
+	// of rows that are split into the color planes right away, so there's no buffer for the
+	// whole block and each chunk is split while it is still in the cache.
+	MPI_Datatype row_type;
+	Set_block_view(in_file_handle, image_info, input_data, start_row, start_col, &row_type);
+
+	int chunks;
+	int chunk_rows = Io_chunk_rows(image_info, &chunks);
+	uint8_t *chunk = malloc((size_t) chunk_rows * image_info->cols * image_info->bytes_per_pixel);
+	for(int i = 0; i != chunks; ++i) {
+		int first_row = i * chunk_rows;
+		int count = image_info->rows - first_row;
+		if(count < 0)
+			count = 0;
+		if(count > chunk_rows)
+			count = chunk_rows;
+
+		MPI_File_read_all(in_file_handle, chunk, count, row_type, MPI_STATUS_IGNORE);
+		Split_colors(image_info, chunk, first_row, count, planes);
+	}
+
+	free(chunk);
+	MPI_Type_free(&row_type);
+	MPI_File_close(&in_file_handle);
+	if(info != MPI_INFO_NULL)
+		MPI_Info_free(&info);
+}
+
+// Write the block of this process straight from the padded color planes.
+void Write_data(int my_rank, image_info_t *image_info, input_data_t *input_data, int start_row, int start_col, uint8_t *planes) {
+#ifdef HAVE_MMAP
+	if(input_data->io == IO_MMAP) {
+		Write_data_mmap(image_info, input_data, start_row, start_col, planes);
+		return;
+	}
+#endif
+
+	MPI_Info info = Io_hints(input_data);
+	MPI_File out_file_handle;
+	MPI_File_open(MPI_COMM_WORLD, input_data->temp_file, MPI_MODE_WRONLY, info, &out_file_handle);
+
+	MPI_Datatype row_type;
+	Set_block_view(out_file_handle, image_info, input_data, start_row, start_col, &row_type);
+
+	// Same as Read_data(), the other way around.
+	int chunks;
+	int chunk_rows = Io_chunk_rows(image_info, &chunks);
+	uint8_t *chunk = malloc((size_t) chunk_rows * image_info->cols * image_info->bytes_per_pixel);
+	for(int i = 0; i != chunks; ++i) {
+		int first_row = i * chunk_rows;
+		int count = image_info->rows - first_row;
+		if(count < 0)
+			count = 0;
+		if(count > chunk_rows)
+			count = chunk_rows;
+
+		Recombine_colors(image_info, planes, first_row, count, chunk);
+		MPI_File_write_all(out_file_handle, chunk, count, row_type, MPI_STATUS_IGNORE);
+	}
+
+	free(chunk);
+	MPI_Type_free(&row_type);
+	MPI_File_close(&out_file_handle);
+	if(info != MPI_INFO_NULL)
+		MPI_Info_free(&info);
+}
+
+// The frames of a batch (--frames) after the first, which Read_data() reads. The files stay open
+// with the views of the block, and a frame is read / written in the background while the one
+// before / after it is convolved.
+typedef struct frame_io {
+	image_info_t *image_info;
+	MPI_Info info;
+	MPI_File in_file_handle;
+	MPI_File out_file_handle;
+	MPI_Datatype row_type;
+	// A frame of the block, as it is in the files.
+	uint8_t *read_buf;
+	uint8_t *write_buf;
+	MPI_Request read_request;
+	MPI_Request write_request;
+} frame_io_t;
+
+void Frame_io_init(frame_io_t *frame_io, image_info_t *image_info, input_data_t *input_data, int start_row, int start_col) {
+	size_t block_bytes = (size_t) image_info->rows * image_info->cols * image_info->bytes_per_pixel;
+	frame_io->image_info = image_info;
+	frame_io->info = Io_hints(input_data);
+	MPI_File_open(MPI_COMM_WORLD, input_data->input_file, MPI_MODE_RDONLY, frame_io->info, &frame_io->in_file_handle);
+	MPI_File_open(MPI_COMM_WORLD, input_data->temp_file, MPI_MODE_WRONLY, frame_io->info, &frame_io->out_file_handle);
+
+	// NOTE: The view of the block tiles the file, one image after the other, so frame f starts
+	// f * rows * cols pixels into it.
+	MPI_Datatype out_row_type;
+	Set_block_view(frame_io->in_file_handle, image_info, input_data, start_row, start_col, &frame_io->row_type);
+	Set_block_view(frame_io->out_file_handle, image_info, input_data, start_row, start_col, &out_row_type);
+	MPI_Type_free(&out_row_type);
+
+	frame_io->read_buf = malloc(block_bytes);
+	frame_io->write_buf = malloc(block_bytes);
+	frame_io->read_request = MPI_REQUEST_NULL;
+	frame_io->write_request = MPI_REQUEST_NULL;
+}
+
+// Start reading a frame, see Frame_io_wait_read().
+void Frame_io_read(frame_io_t *frame_io, int frame) {
+	image_info_t *image_info = frame_io->image_info;
+	MPI_Offset offset = (MPI_Offset) frame * image_info->rows * image_info->cols;
+	MPI_File_iread_at(frame_io->in_file_handle, offset, frame_io->read_buf, image_info->rows, frame_io->row_type, &frame_io->read_request);
+}
+
+// Wait for the frame that is being read and split it into the planes.
+void Frame_io_wait_read(frame_io_t *frame_io, uint8_t *planes) {
+	image_info_t *image_info = frame_io->image_info;
+	MPI_Wait(&frame_io->read_request, MPI_STATUS_IGNORE);
+	Split_colors(image_info, frame_io->read_buf, 0, image_info->rows, planes);
+}
+
+// Start writing a frame from the planes, once the previous one is written.
+void Frame_io_write(frame_io_t *frame_io, int frame, uint8_t *planes) {
+	image_info_t *image_info = frame_io->image_info;
+	MPI_Offset offset = (MPI_Offset) frame * image_info->rows * image_info->cols;
+	MPI_Wait(&frame_io->write_request, MPI_STATUS_IGNORE);
+	Recombine_colors(image_info, planes, 0, image_info->rows, frame_io->write_buf);
+	MPI_File_iwrite_at(frame_io->out_file_handle, offset, frame_io->write_buf, image_info->rows, frame_io->row_type, &frame_io->write_request);
+}
+
+// Wait for the last frame to be written and close the files.
+void Frame_io_close(frame_io_t *frame_io) {
+	MPI_Wait(&frame_io->read_request, MPI_STATUS_IGNORE);
+	MPI_Wait(&frame_io->write_request, MPI_STATUS_IGNORE);
+	free(frame_io->read_buf);
+	free(frame_io->write_buf);
+	MPI_Type_free(&frame_io->row_type);
+	MPI_File_close(&frame_io->in_file_handle);
+	MPI_File_close(&frame_io->out_file_handle);
+	if(frame_io->info != MPI_INFO_NULL)
+		MPI_Info_free(&frame_io->info);
 }
 
 ///        CONVOLUTION       ///
 
-int fill_pixels(int curr_row, int curr_col, int width, uint8_t *start_data, uint8_t *cache_out, float *conv_matrix, int check, int check_similarity) {
-	float pixel = 0;
+// Return whether the pixel changed.
+int fill_pixels(int curr_row, int curr_col, int width, uint8_t *start_data, uint8_t *cache_out, kernel_t *kernel) {
+	int radius = kernel->radius;
+	float *conv_matrix = kernel->matrix;
+	float pixel = kernel->bias;
 	int k = 0;
-	// Gather the 8 surrounding pixels for each source pixel.
-	for(int i = curr_row - 1; i <= curr_row + 1; ++i)
-		for(int j = curr_col - 1; j <= curr_col + 1; ++j)
-			pixel += start_data[i * width + j] * conv_matrix[k++];
+	// Gather the surrounding pixels for each source pixel.
+	for(int i = curr_row - radius; i <= curr_row + radius; ++i)
+		for(int j = curr_col - radius; j <= curr_col + radius; ++j)
+			pixel += start_data[(size_t) i * width + j] * conv_matrix[k++];
+
+	// NOTE: Kernels with negative weights (sharpen) can leave [0, 255].
+	size_t pos = (size_t) curr_row * width + curr_col;
+	uint8_t value = (pixel < 0.0f) ? 0 : (pixel > 255.0f) ? 255 : (uint8_t) pixel;
+	cache_out[pos] = value;
 
-	cache_out[curr_row * width + curr_col] = pixel;
+	return value != start_data[pos];
+}
 
- 	if ((check_similarity) && (!check))
-    	check = Check_similarity(start_data,cache_out,(curr_row * width + curr_col));
+// Convolution with a separable kernel, i.e. col (x) row. For each output row, first the
+// source rows are combined vertically and then the partial sums are combined
+// horizontally, so 2 * size multiply-adds per pixel instead of size^2. The partial sums are
+// computed in chunks of columns so that they stay in L1.
+// Return whether any pixel changed.
+int compute_separable(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel) {
+	float partial[SEPARABLE_CHUNK + 2 * MAX_KERNEL_RADIUS];
+	int radius = kernel->radius;
+	int size = kernel->size;
+	float *col_k = kernel->col;
+	float *row_k = kernel->row;
+	int changed = 0;
+
+	for(int row = start_row; row <= end_row; ++row) {
+		uint8_t *top_row = cache_in + (size_t) (row - radius) * width;
+		uint8_t *center = cache_in + (size_t) row * width;
+		uint8_t *out = cache_out + (size_t) row * width;
+
+		for(int chunk = start_col; chunk <= end_col; chunk += SEPARABLE_CHUNK) {
+			int last = chunk + SEPARABLE_CHUNK - 1;
+			if(last > end_col)
+				last = end_col;
+
+			// Vertical pass, including radius columns on each side.
+			for(int col = chunk - radius; col <= last + radius; ++col) {
+				float sum = 0;
+				for(int i = 0; i < size; ++i)
+					sum += top_row[i * width + col] * col_k[i];
+				partial[col - chunk + radius] = sum;
+			}
 
-	return check;
+			// Horizontal pass.
+			for(int col = chunk; col <= last; ++col) {
+				float *p = partial + (col - chunk);
+				float pixel = kernel->bias;
+				for(int j = 0; j < size; ++j)
+					pixel += p[j] * row_k[j];
+				uint8_t value = (pixel < 0.0f) ? 0 : (pixel > 255.0f) ? 255 : (uint8_t) pixel;
+				out[col] = value;
+				// Compared as it is stored, without a branch.
+				changed |= (value != center[col]);
+			}
+		}
+	}
+
+	return changed;
 }
 
-int compute(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, float *convolution_matrix, long int avail_threads, int check_similarity) {
+// Return whether any pixel changed (only if check_similarity).
+int compute(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, long int avail_threads, int check_similarity) {
 
-    int check = 0;
+	int changed = 0;
 	int row, col;
-	for(row = start_row; row <= end_row; ++row)
-		for(col = start_col; col <= end_col; ++col)
-			  //NOTE(maria): check refers to whether img is changed or not
-		      check = fill_pixels(row, col, width, cache_in, cache_out, convolution_matrix, check, check_similarity);
-    return check;
+
+#ifdef _OPENMP
+	// Split the rows in bands, one per thread.
+	if(avail_threads > 1 && end_row - start_row + 1 >= avail_threads) {
+		int region_rows = end_row - start_row + 1;
+		#pragma omp parallel for num_threads(avail_threads) schedule(static) reduction(|:changed)
+		for(int band = 0; band < avail_threads; ++band) {
+			int band_start = start_row + region_rows * band / avail_threads;
+			int band_end = start_row + region_rows * (band + 1) / avail_threads - 1;
+			changed |= compute(cache_in, cache_out, band_start, band_end, start_col, end_col, width, kernel, 1, check_similarity);
+		}
+		return changed;
+	}
+#endif
+
+	if(kernel->separable) {
+		changed = compute_separable(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel);
+	} else {
+		for(row = start_row; row <= end_row; ++row)
+			for(col = start_col; col <= end_col; ++col)
+				changed |= fill_pixels(row, col, width, cache_in, cache_out, kernel);
+	}
+
+	return check_similarity && changed;
+}
+
+// Advance a region of one color plane 'steps' iterations, with kernels[s] on step s, where step s
+// computes the region grown by the radii of the steps after it, on the sides where grow[] is 1
+// (top, bottom, left, right). The rows are swept in bands of tile_rows, skewed by the largest
+// radius per step (a wavefront), so that all the steps of a band are done while it is in the
+// cache. Step s reads from cache_in if s is even, from cache_out otherwise, so the result is in
+// cache_out if steps is odd.
+// NOTE: A band writes step s + 1 right above the rows of step s - 1 that the next band still
+// reads, so two buffers are enough. That takes a skew of at least the radius of step s per step,
+// hence the largest one when the kernels differ.
+// Return whether the last step changed any pixel (only if check_similarity).
+int compute_skewed(uint8_t *cache_in, uint8_t *cache_out, int steps, int start_row, int end_row, int start_col, int end_col, int grow[4], int width, int tile_rows, kernel_t **kernels, long int avail_threads, int check_similarity) {
+	// The largest radius, and how far the first step reaches past the region.
+	int radius = 0;
+	int reach = 0;
+	for(int step = 0; step != steps; ++step) {
+		if(kernels[step]->radius > radius)
+			radius = kernels[step]->radius;
+		if(step)
+			reach += kernels[step]->radius;
+	}
+	int first_row = start_row - reach * grow[0];
+	int last_row = end_row + reach * grow[1];
+	int check = 0;
+
+	// One band for all the rows: plain sweeps of the whole region.
+	if(tile_rows <= 0)
+		tile_rows = last_row - first_row + 1 + (steps - 1) * radius;
+
+	int last_band = 0;
+	for(int band = first_row; !last_band; band += tile_rows) {
+		last_band = (band + tile_rows - 1 - (steps - 1) * radius >= end_row);
+		int extra = reach;
+		for(int step = 0; step != steps; ++step) {
+			if(step)
+				extra -= kernels[step]->radius;
+			int step_first = start_row - extra * grow[0];
+			int step_last = end_row + extra * grow[1];
+			int lo = (band == first_row) ? step_first : band - step * radius;
+			int hi = last_band ? step_last : band + tile_rows - 1 - step * radius;
+			if(lo < step_first)
+				lo = step_first;
+			if(hi > step_last)
+				hi = step_last;
+			if(lo > hi)
+				continue;
+
+			uint8_t *in = (step % 2) ? cache_out : cache_in;
+			uint8_t *out = (step % 2) ? cache_in : cache_out;
+			int check_step = check_similarity && (step == steps - 1);
+			check |= compute(in, out, lo, hi, start_col - extra * grow[2], end_col + extra * grow[3], width, kernels[step], avail_threads, check_step);
+		}
+	}
+
+	return check;
+}
+
+// If the kernel has rank 1, i.e. it is the outer product of a column
+// and a row vector, store the two vectors and return 1.
+int factor_kernel(kernel_t *kernel) {
+	int size = kernel->size;
+	float *matrix = kernel->matrix;
+	int pivot = 0;
+
+	// Factor around the largest element, for stability.
+	for(int i = 1; i < size * size; ++i)
+		if(fabsf(matrix[i]) > fabsf(matrix[pivot]))
+			pivot = i;
+	if(matrix[pivot] == 0.0f)
+		return 0;
+
+	int pivot_row = pivot / size;
+	int pivot_col = pivot % size;
+	for(int i = 0; i < size; ++i) {
+		kernel->col[i] = matrix[i * size + pivot_col] / matrix[pivot];
+		kernel->row[i] = matrix[pivot_row * size + i];
+	}
+
+	for(int i = 0; i < size; ++i)
+		for(int j = 0; j < size; ++j)
+			if(fabsf(kernel->col[i] * kernel->row[j] - matrix[i * size + j]) > SEPARABLE_TOLERANCE * fabsf(matrix[pivot]))
+				return 0;
+
+	return 1;
 }
 
-void normalize_kernel(float *conv_matrix) {
+void normalize_kernel(kernel_t *kernel) {
+	float *conv_matrix = kernel->matrix;
+	int elements = kernel->size * kernel->size;
 	float sum = 0.0;
-	for(int i = 0; i < 9; ++i)
+	for(int i = 0; i < elements; ++i)
 		sum += conv_matrix[i];
 
-	for(int i = 0; i < 9; ++i)
+	for(int i = 0; i < elements; ++i)
 		conv_matrix[i] /= sum;
+
+	kernel->separable = factor_kernel(kernel);
+}
+
+// Gaussian blur approximated by binomial coefficients, the outer product
+// of the (2 * radius)th row of Pascal's triangle with itself (1 2 1 for radius 1).
+void gaussian_kernel(kernel_t *kernel, int radius) {
+	float binomial[MAX_KERNEL_SIZE];
+	int size = 2 * radius + 1;
+
+	binomial[0] = 1.0f;
+	for(int n = 1; n < size; ++n) {
+		binomial[n] = 1.0f;
+		for(int k = n - 1; k > 0; --k)
+			binomial[k] += binomial[k - 1];
+	}
+
+	kernel->radius = radius;
+	kernel->size = size;
+	for(int i = 0; i < size; ++i)
+		for(int j = 0; j < size; ++j)
+			kernel->matrix[i * size + j] = binomial[i] * binomial[j];
+
+	normalize_kernel(kernel);
+}
+
+// Mean of the (2 * radius + 1) x (2 * radius + 1) neighborhood.
+void box_kernel(kernel_t *kernel, int radius) {
+	kernel->radius = radius;
+	kernel->size = 2 * radius + 1;
+	for(int i = 0; i < kernel->size * kernel->size; ++i)
+		kernel->matrix[i] = 1.0f;
+
+	normalize_kernel(kernel);
+}
+
+// The image minus its (4-neighbor) Laplacian.
+void sharpen_kernel(kernel_t *kernel) {
+	const float sharpen[9] = {
+		 0.0f, -1.0f,  0.0f,
+		-1.0f,  5.0f, -1.0f,
+		 0.0f, -1.0f,  0.0f
+	};
+
+	kernel->radius = 1;
+	kernel->size = 3;
+	for(int i = 0; i < 9; ++i)
+		kernel->matrix[i] = sharpen[i];
+
+	normalize_kernel(kernel);
+}
+
+// The --kernel, as normalized by Get_input(), and its --bias.
+void custom_kernel(kernel_t *kernel, input_data_t *input_data) {
+	kernel->size = input_data->kernel_size;
+	kernel->radius = kernel->size / 2;
+	for(int i = 0; i < kernel->size * kernel->size; ++i)
+		kernel->matrix[i] = input_data->kernel_weights[i];
+	kernel->bias = input_data->kernel_bias;
+
+	kernel->separable = factor_kernel(kernel);
+}
+
+void stage_kernel(kernel_t *kernel, input_data_t *input_data, int stage) {
+	int radius = input_data->stage_radius[stage];
+	kernel->bias = 0.0f;
+	switch(input_data->stage_kernel[stage]) {
+	case KERNEL_BOX:
+		box_kernel(kernel, radius);
+		break;
+	case KERNEL_SHARPEN:
+		sharpen_kernel(kernel);
+		break;
+	case KERNEL_CUSTOM:
+		custom_kernel(kernel, input_data);
+		break;
+	default:
+		gaussian_kernel(kernel, radius);
+	}
 }
 
 int main(int argc, char **argv) {
@@ -295,14 +1663,12 @@ int main(int argc, char **argv) {
 
 	double local_elapsed, elapsed;
 
-	MPI_Init(&argc, &argv);
+	// NOTE: The computation may be multithreaded, but only the main thread calls MPI.
+	int thread_support;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
 	MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
 	MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
 
-	// gaussian blur
-	float convolution_matrix[9] = { 1.0, 2.0, 1.0, 2.0, 4.0, 2.0, 1.0, 2.0, 1.0 };
-	normalize_kernel(convolution_matrix);
-
 	int width_div;
 	input_data_t input_data;
 
@@ -313,38 +1679,87 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
+	// The kernels of the stages of the pipeline, and the one of every iteration: 'times' passes
+	// through the stages, in order.
+	kernel_t kernels[MAX_STAGES];
+	int radius = 0;  // the largest
+	for(int s = 0; s != input_data.stages; ++s) {
+		stage_kernel(&kernels[s], &input_data, s);
+		if(kernels[s].radius > radius)
+			radius = kernels[s].radius;
+	}
+	int iterations = input_data.times * pass_iterations(&input_data);
+	kernel_t **iteration_kernels = malloc((iterations + 1) * sizeof(kernel_t *));
+	int iteration = 0;
+	for(int pass = 0; pass != input_data.times; ++pass)
+		for(int s = 0; s != input_data.stages; ++s)
+			for(int n = 0; n != input_data.stage_count[s]; ++n)
+				iteration_kernels[iteration++] = &kernels[s];
+
 	image_info_t image_info;
 	int start_row, start_col;
 
-	image_info.rows = input_data.height / (comm_sz / width_div);
-	image_info.cols = input_data.width / width_div;
+	// Grid of processes. MPI may reorder the ranks so that neighbors are close on the machine.
+	int dims[2] = {comm_sz / width_div, width_div};
+	int periods[2] = {0, 0};
+	int coords[2];
+	int cart_rank;
+	MPI_Comm cart_comm;
+	MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 1, &cart_comm);
+	MPI_Comm_rank(cart_comm, &cart_rank);
+	MPI_Cart_coords(cart_comm, cart_rank, 2, coords);
+
+	// NOTE: When the dimensions don't divide evenly, the first processes of each dimension get 1 more row / column.
+	image_info.rows = block_size(input_data.height, dims[0], coords[0], &start_row);
+	image_info.cols = block_size(input_data.width, dims[1], coords[1], &start_col);
 	image_info.bytes_per_pixel = input_data.bytes_per_pixel;
+	// NOTE: With temporal blocking, the halos are wide enough for steps_per_exchange iterations.
+	image_info.padding = halo_width(&input_data, iterations, input_data.steps_per_exchange);
 
     int bytes_per_pixel = image_info.bytes_per_pixel;
 	int cols = image_info.cols;
 	int rows = image_info.rows;
-	int times = input_data.times;
+	int pad = image_info.padding;
+	int padded_cols = cols + 2 * pad;
+	int padded_rows = rows + 2 * pad;
 	int check_similarity = input_data.sim_flag;
+	int steps_per_exchange = input_data.steps_per_exchange;
+
+	// Threads per process.
+	long int avail_threads = 1;
+#ifdef _OPENMP
+	avail_threads = (input_data.threads > 0) ? input_data.threads : omp_get_max_threads();
+	if(avail_threads > 1 && thread_support < MPI_THREAD_FUNNELED) {
+		if(my_rank == 0)
+			fprintf(stderr, "[%s]: The MPI library doesn't support threads, using 1 per process\n", argv[0]);
+		avail_threads = 1;
+	}
+#endif
+
+	int tile_rows = input_data.tile_rows;
+	if(tile_rows < 0) {
+		// Every thread's part of a tile of both arrays, plus the rows that the skew and the kernel
+		// add, should fit in its L2.
+		tile_rows = avail_threads * (L2_CACHE_SIZE / (2 * padded_cols)) - (steps_per_exchange + 1) * radius;
+		if(tile_rows < radius)
+			tile_rows = radius;
+	}
 
-	// Track where each process's rectangle is in the whole image.
-	start_row = (my_rank / width_div) * image_info.rows;
-	start_col = (my_rank % width_div) * image_info.cols;
+	// NOTE(stefanos): 'pad' padding lines above and below the valid ones.
+	// Also, 'pad' padding pixels on each side of every valid line.
+	uint8_t *src = Alloc_planes(bytes_per_pixel, padded_rows, padded_cols, avail_threads);
+	uint8_t *dst = Alloc_planes(bytes_per_pixel, padded_rows, padded_cols, avail_threads);
 
-	// NOTE(stefanos): 2 padding lines, one above and one below the valid ones.
-	// Also, 2 padding pixels for each valid line, one left, one right.
-	int per_process_bytes = image_info.bytes_per_pixel * (image_info.rows + 2) * (image_info.cols + 2);
-	uint8_t *src = calloc(per_process_bytes, sizeof(uint8_t));
-	uint8_t *dst = calloc(per_process_bytes, sizeof(uint8_t));
 
-	uint8_t *buffer = malloc(image_info.rows * image_info.cols * image_info.bytes_per_pixel * sizeof(uint8_t));
+	// NOTE: The output file is created here, outside of the timed phases.
+	Create_output(my_rank, &input_data);
 
 	/// Read Data ///
 
 	MPI_Barrier(MPI_COMM_WORLD);
 	local_elapsed = MPI_Wtime();
 
-	Read_data(&image_info, &input_data, start_row, start_col, buffer);
-	Split_colors(&image_info, buffer, src);
+	Read_data(&image_info, &input_data, start_row, start_col, src);
 
 	local_elapsed = MPI_Wtime() - local_elapsed;
 	MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
@@ -352,122 +1767,186 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Read Data: %.15lf seconds\n", elapsed);
 	}
 
-    MPI_Datatype col_type;
-    MPI_Datatype row_type;
-
-	// Type to send one whole padding column
-	MPI_Type_vector(bytes_per_pixel * (rows+2), 1, cols+2, MPI_BYTE, &col_type);
-	MPI_Type_commit(&col_type);
-	// Type to send bytes_per_pixel rows, each of whome is 1 color's bytes worth (including the padding) apart.
-	MPI_Type_vector(bytes_per_pixel, cols, (rows+2)*(cols+2), MPI_BYTE, &row_type);
-	MPI_Type_commit(&row_type);
-
-	/// Compute neighbors. ///
+	halo_t halo;
+	uint8_t *planes[2] = {src, dst};
+	Halo_init(&halo, cart_comm, &image_info, sizeof(uint8_t), MPI_BYTE, input_data.exchange, input_data.packed_halos, input_data.halo_sides, planes);
 
-	// Initialization to null process, i.e. no neighbor.
-	int top = MPI_PROC_NULL;
-	int bottom = MPI_PROC_NULL;
-	int left = MPI_PROC_NULL;
-	int right = MPI_PROC_NULL;
+	int top = halo.neighbors[HALO_TOP];
+	int bottom = halo.neighbors[HALO_BOTTOM];
+	int left = halo.neighbors[HALO_LEFT];
+	int right = halo.neighbors[HALO_RIGHT];
 
-    if(start_row != 0)
-		top = my_rank - width_div;
-	if(start_row + image_info.rows != input_data.height)
-		bottom = my_rank + width_div;
-	if(start_col != 0)
-		left = my_rank - 1;
-	if(start_col + image_info.cols != input_data.width)
-		right = my_rank + 1;
-
-    // 0: top   1: bottom
-    // 2: left  3: right
-    MPI_Request send_req[4], recv_req[4];
+	// NOTE: The frames of a batch reuse the decomposition, the halo exchange and the arrays.
+	// Each one after the first is read while the one before it is convolved, and written
+	// while the one after it is.
+	int frames = input_data.frames;
+	frame_io_t frame_io;
+	if(frames > 1)
+		Frame_io_init(&frame_io, &image_info, &input_data, start_row, start_col);
 
 	MPI_Barrier(MPI_COMM_WORLD);
 	local_elapsed = MPI_Wtime();
 
-	for(int t = 0; t != times; ++t) {
-
-		// top
-		MPI_Isend(src + (cols+2) + 1, 1, row_type, top, 0, MPI_COMM_WORLD, &send_req[0]);
-		MPI_Irecv(src + 1, 1, row_type, top, 0, MPI_COMM_WORLD, &recv_req[0]);
-
-		// bottom
-		MPI_Isend(src + rows*(cols+2) + 1, 1, row_type, bottom, 0, MPI_COMM_WORLD, &send_req[1]);
-		MPI_Irecv(src + (rows+1)*(cols+2) + 1, 1, row_type, bottom, 0, MPI_COMM_WORLD, &recv_req[1]);
-
-		// left
-		MPI_Isend(src + 1, 1, col_type, left, 0, MPI_COMM_WORLD, &send_req[2]);
-		MPI_Irecv(src , 1, col_type, left, 0, MPI_COMM_WORLD, &recv_req[2]);
-
-		// right
-		MPI_Isend(src + (cols+2) - 2, 1, col_type, right, 0, MPI_COMM_WORLD, &send_req[3]);
-		MPI_Irecv(src + (cols+2) - 1, 1, col_type, right, 0, MPI_COMM_WORLD, &recv_req[3]);
-
-		// compute inner data
-        int local_sim_flag;
-		for(int color = 0; color != bytes_per_pixel; ++color) {
-			// NOTE(maria): We check similarity only in inner data conv
-		    local_sim_flag = compute(src, dst, color * (rows+2) + 1, (color+1) * (rows+2) - 2,
-				1, cols, cols + 2, convolution_matrix, 0, check_similarity);
-		}
-
-		MPI_Wait(&recv_req[0], MPI_STATUS_IGNORE);
-		MPI_Wait(&recv_req[1], MPI_STATUS_IGNORE);
-		MPI_Wait(&recv_req[2], MPI_STATUS_IGNORE);
-		MPI_Wait(&recv_req[3], MPI_STATUS_IGNORE);
-
-		/// Compute outer data ///
-		// NOTE(maria): Last parameter is initilized to 0
-		// in order to skip similarity_check
-		if(top != MPI_PROC_NULL) {
-			for(int color = 0; color != bytes_per_pixel; ++color) {
-				compute(src, dst, color * (rows+2) + 1, color * (rows+2) + 1,
-					1, cols, cols + 2, convolution_matrix, 0, 0);
+	// NOTE: Temporal blocking. Every exchange fills halos of 'pad' rows / columns, as many as the
+	// radii of 'steps' iterations add up to, which is enough to advance them without talking to
+	// the neighbors. Each step computes the region that the next steps still need: the block plus
+	// the radii of the steps after it, into the halo on the sides that have a neighbor. The last
+	// step computes just the block, so the result is the same as exchanging on every iteration.
+	// Consecutive stages of the pipeline are fused the same way.
+	// Whether the region of each step grows into the halos (top, bottom, left, right).
+	int grow[4];
+	grow[0] = (top != MPI_PROC_NULL);
+	grow[1] = (bottom != MPI_PROC_NULL);
+	grow[2] = (left != MPI_PROC_NULL);
+	grow[3] = (right != MPI_PROC_NULL);
+	// NOTE: The similarity check of a block of iterations is reduced while the next block is
+	// computed, and waited for after it. So it stops 1 block late, which changes nothing when
+	// that block is of the same kernel (see below).
+	int local_changed, any_changed, checked_iteration = 0;
+	MPI_Request sim_request = MPI_REQUEST_NULL;
+	for(int frame = 0; frame != frames; ++frame) {
+		// The next frame is read while this one is convolved.
+		if(frame + 1 != frames)
+			Frame_io_read(&frame_io, frame + 1);
+
+		int steps;
+		for(int t = 0; t < iterations; t += steps) {
+			steps = (iterations - t < steps_per_exchange) ? iterations - t : steps_per_exchange;
+			kernel_t *kernel = iteration_kernels[t];
+
+			Halo_start(&halo, src);
+
+			// How far into the halos the first step has to compute: the radii of the steps after it.
+			int extra = 0;
+			for(int step = 1; step < steps; ++step)
+				extra += iteration_kernels[t + step]->radius;
+			int top_extra = (top != MPI_PROC_NULL) ? extra : 0;
+			int bottom_extra = (bottom != MPI_PROC_NULL) ? extra : 0;
+			int left_extra = (left != MPI_PROC_NULL) ? extra : 0;
+			int right_extra = (right != MPI_PROC_NULL) ? extra : 0;
+			// Check similarity on the blocks that reach a multiple of sim_flag iterations.
+			// NOTE: Only the last step of an exchange computes exactly the block, so check
+			// similarity there.
+			int check_block = check_similarity && (t + steps) / check_similarity != t / check_similarity;
+			int check_step = check_block && (steps == 1);
+			// Whether any color changed.
+			int local_sim_flag = 0;
+
+			// NOTE: The region of the first step is split in 3 x 3 parts: the inner one, which reads
+			// only the block, the 4 edges and the 4 corners. Each part is computed as soon as the halos
+			// it reads have arrived, so the inner one while all of them are in flight.
+			// Where the parts start, and where the region ends (+ 1), for the rows and the columns.
+			int r0 = kernel->radius;
+			int row_cuts[4] = {pad - top_extra, pad + grow[0] * r0, pad + rows - grow[1] * r0, pad + rows + bottom_extra};
+			int col_cuts[4] = {pad - left_extra, pad + grow[2] * r0, pad + cols - grow[3] * r0, pad + cols + right_extra};
+			// Small blocks: the edges take all of it and there's no inner part.
+			if(row_cuts[1] > row_cuts[2])
+				row_cuts[1] = row_cuts[2];
+			if(col_cuts[1] > col_cuts[2])
+				col_cuts[1] = col_cuts[2];
+
+			// The inner part goes first.
+			const int part_order[9] = {4, 0, 1, 2, 3, 5, 6, 7, 8};
+			int needs[9];
+			int pending = 0;
+			for(int part = 0; part != 9; ++part) {
+				int r = part / 3;
+				int c = part % 3;
+				if(row_cuts[r] == row_cuts[r + 1] || col_cuts[c] == col_cuts[c + 1])
+					continue;
+				needs[part] = Halo_needs(&halo, row_cuts[r] - r0, row_cuts[r + 1] - 1 + r0,
+					col_cuts[c] - r0, col_cuts[c + 1] - 1 + r0);
+				pending |= 1 << part;
 			}
-		}
 
-		if(bottom != MPI_PROC_NULL) {
-			for(int color = 0; color != bytes_per_pixel; ++color) {
-				compute(src, dst, (color+1) * (rows+2) - 2, (color+1) * (rows+2) - 2,
-					1, cols, cols + 2, convolution_matrix, 0, 0);
+			int poll_rows = POLL_ROWS * avail_threads;
+			int arrived = Halo_progress(&halo, 0);
+			while(pending) {
+				for(int i = 0; i != 9; ++i) {
+					int part = part_order[i];
+					if(!(pending & (1 << part)) || (needs[part] & ~arrived))
+						continue;
+
+					// In chunks of rows, checking on the exchange in between.
+					int r = part / 3;
+					int c = part % 3;
+					for(int first = row_cuts[r]; first < row_cuts[r + 1]; first += poll_rows) {
+						int last = (first + poll_rows < row_cuts[r + 1]) ? first + poll_rows - 1 : row_cuts[r + 1] - 1;
+						for(int color = 0; color != bytes_per_pixel; ++color) {
+							local_sim_flag |= compute(src, dst, color * padded_rows + first, color * padded_rows + last,
+								col_cuts[c], col_cuts[c + 1] - 1, padded_cols, kernel, avail_threads, check_step);
+						}
+						arrived = Halo_progress(&halo, 0);
+					}
+					pending &= ~(1 << part);
+				}
+
+				if(pending)
+					arrived = Halo_progress(&halo, 1);
 			}
-		}
 
-		if(left != MPI_PROC_NULL) {
-			for(int color = 0; color != bytes_per_pixel; ++color) {
-				compute(src, dst, color * (rows+2) + 1, (color+1) * (rows+2) - 2,
-					1, 1, cols + 2, convolution_matrix, 0, 0);
+			Halo_wait_send(&halo);
+
+			// Swap arrays
+			uint8_t *temp = src;
+			src = dst;
+			dst = temp;
+
+			// The rest of the steps need no communication, do them tile by tile.
+			if(steps > 1) {
+				for(int color = 0; color != bytes_per_pixel; ++color) {
+					local_sim_flag |= compute_skewed(src, dst, steps - 1, color * padded_rows + pad, color * padded_rows + pad + rows - 1,
+						pad, pad + cols - 1, grow, padded_cols, tile_rows, iteration_kernels + t + 1, avail_threads, check_block);
+				}
+
+				if((steps - 1) % 2) {
+					temp = src;
+					src = dst;
+					dst = temp;
+				}
 			}
-		}
 
-		if(right != MPI_PROC_NULL) {
-			for(int color = 0; color != bytes_per_pixel; ++color) {
-				compute(src, dst, color * (rows+2) + 1, (color+1) * (rows+2) - 2,
-					cols, cols, cols + 2, convolution_matrix, 0, 0);
+			// Check for similarity
+			// between src and dst image: the check of the block before, and then the one of this block.
+			// NOTE: The arrays are already swapped, but if nothing changed, they are the same anyway.
+			if(sim_request != MPI_REQUEST_NULL) {
+				MPI_Wait(&sim_request, MPI_STATUS_IGNORE);
+				//if none part of img
+				//is changed after convolution
+				if(!any_changed) {
+					// NOTE: The image is then the same after any number of iterations of the checked
+					// kernel, but not of the other stages of a pipeline. So stop only if the rest are all
+					// of that kernel. Otherwise, if the iterations since the check were of it too, skip
+					// to the next stage.
+					int next = checked_iteration;
+					while(next != iterations && iteration_kernels[next] == iteration_kernels[checked_iteration - 1])
+						++next;
+					if(next == iterations) {
+						if(my_rank == 0)
+							fprintf(stderr, "Iteration %d changed no pixel, stopped after %d\n", checked_iteration, t + steps);
+						break;
+					}
+					if(next > t + steps) {
+						if(my_rank == 0)
+							fprintf(stderr, "Iteration %d changed no pixel, skipped to %d\n", checked_iteration, next);
+						check_block = 0;
+						t = next - steps;
+					}
+				}
+			}
+			if(check_block) {
+				local_changed = local_sim_flag;
+				checked_iteration = t + steps;
+				MPI_Iallreduce(&local_changed, &any_changed, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD, &sim_request);
 			}
 		}
+		MPI_Wait(&sim_request, MPI_STATUS_IGNORE);
 
-		MPI_Wait(&send_req[0], MPI_STATUS_IGNORE);
-		MPI_Wait(&send_req[1], MPI_STATUS_IGNORE);
-		MPI_Wait(&send_req[2], MPI_STATUS_IGNORE);
-		MPI_Wait(&send_req[3], MPI_STATUS_IGNORE);
-
-		// Check for similarity
-		// between src and dst image
-		if(check_similarity){
-            int global_sum;
-            MPI_Allreduce(&local_sim_flag, &global_sum, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-			//if sum == 0 none part of img
-			//is changed after convolution
-			if(global_sum == 0)
-                break;
+		if(frames > 1) {
+			Frame_io_write(&frame_io, frame, src);
+			if(frame + 1 != frames)
+				Frame_io_wait_read(&frame_io, src);
 		}
-
-        // Swap arrays
-		uint8_t *temp = src;
-		src = dst;
-		dst = temp;
 	}
 
 	local_elapsed = MPI_Wtime() - local_elapsed;
@@ -480,16 +1959,23 @@ int main(int argc, char **argv) {
 	MPI_Barrier(MPI_COMM_WORLD);
 	local_elapsed = MPI_Wtime();
 
-	Recombine_colors(&image_info, src, buffer);
-	Write_data(my_rank, &image_info, &input_data, start_row, start_col, buffer);
+	if(frames > 1)
+		Frame_io_close(&frame_io);
+	else
+		Write_data(my_rank, &image_info, &input_data, start_row, start_col, src);
+	Rename_output(my_rank, &input_data);
 
 	local_elapsed = MPI_Wtime() - local_elapsed;
 	MPI_Reduce(&local_elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
 	if(my_rank == 0)
 		fprintf(stderr, "Read Data: %.15lf seconds\n", elapsed);
 
+	Halo_free(&halo);
+	MPI_Comm_free(&cart_comm);
+
 	free(src);
 	free(dst);
+	free(iteration_kernels);
 	free(input_data.input_file);
 
 	MPI_Finalize();
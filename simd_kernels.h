@@ -0,0 +1,1089 @@
+// The convolution code of mpi_simd.c for one instruction set, SIMD_ISA (one of ISA_*), and
+// the color splitting and halo packing that use SIMD too.
+// mpi_simd.c includes this once per instruction set. Each time, the functions get its suffix
+// (SIMD_NAME) and are compiled for it, whatever the flags of the rest of the file, so one binary
+// has the code of all of them and picks one at startup, see detect_isa().
+// NOTE: So there's no include guard.
+// If check_similarity, the engines return whether they changed any pixel: each register of the
+// result is compared with the one of the input as it is stored, so there's no second pass.
+
+#ifndef SIMD_NAME
+#	define SIMD_CONCAT(name, suffix) name##_##suffix
+#	define SIMD_EXPAND(name, suffix) SIMD_CONCAT(name, suffix)
+#	define SIMD_NAME(name) SIMD_EXPAND(name, SIMD_SUFFIX)
+#endif
+
+// Compile the functions below for the instruction set (MSVC compiles the intrinsics of any of them).
+#if defined(__clang__)
+#	if SIMD_ISA == ISA_SSE41
+#		pragma clang attribute push(__attribute__((target("sse4.1"))), apply_to = function)
+#	elif SIMD_ISA == ISA_AVX2
+#		pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#	elif SIMD_ISA == ISA_AVX512
+#		pragma clang attribute push(__attribute__((target("avx512f,avx512bw,fma"))), apply_to = function)
+#	endif
+#elif defined(__GNUC__)
+#	pragma GCC push_options
+#	if SIMD_ISA == ISA_SSE41
+#		pragma GCC target("sse4.1")
+#	elif SIMD_ISA == ISA_AVX2
+#		pragma GCC target("avx2,fma")
+#	elif SIMD_ISA == ISA_AVX512
+#		pragma GCC target("avx512f,avx512bw,fma")
+#	endif
+#endif
+
+// The registers of floats (VEC) and bytes (VECI), and the operations on them.
+// MADD_PS / MADD_SS multiply-add, used by both the vector and the scalar code so that they
+// round the same way. With FMA, the product is not rounded separately.
+// VEC_DIFF / VECI_DIFF_8 are not 0 if any of the floats / bytes of two registers differ.
+#if SIMD_ISA == ISA_SSE41
+#	define SIMD_SUFFIX sse41
+#	define VEC_BYTES 16
+#	define VEC __m128
+#	define VEC_SET1(x) _mm_set1_ps(x)
+#	define VEC_BROADCAST(p) _mm_load1_ps(p)
+#	define VEC_LOADU(p) _mm_loadu_ps(p)
+#	define VEC_STORE(p, v) _mm_store_ps(p, v)
+#	define VEC_STOREU(p, v) _mm_storeu_ps(p, v)
+#	define VEC_ADD(a, b) _mm_add_ps(a, b)
+#	define VEC_MUL(a, b) _mm_mul_ps(a, b)
+#	define VEC_DIFF(a, b) _mm_movemask_ps(_mm_cmpneq_ps(a, b))
+#	define MADD_PS(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#	define MADD_SS(a, b, c) ((a) * (b) + (c))
+#	define VECI __m128i
+#	define VECI_ZERO() _mm_setzero_si128()
+#	define VECI_SET1_16(x) _mm_set1_epi16(x)
+#	define VECI_LOADU(p) _mm_loadu_si128((__m128i *) (p))
+#	define VECI_STOREU(p, v) _mm_storeu_si128((__m128i *) (p), v)
+#	define VECI_ADD_16(a, b) _mm_add_epi16(a, b)
+#	define VECI_MADDUBS_16(a, b) _mm_maddubs_epi16(a, b)
+#	define VECI_UNPACKLO_8(a, b) _mm_unpacklo_epi8(a, b)
+#	define VECI_UNPACKHI_8(a, b) _mm_unpackhi_epi8(a, b)
+#	define VECI_SRL_16(a, count) _mm_srl_epi16(a, count)
+#	define VECI_SRA_16(a, count) _mm_sra_epi16(a, count)
+#	define VECI_MIN_U16(a, b) _mm_min_epu16(a, b)
+#	define VECI_PACKUS_16(a, b) _mm_packus_epi16(a, b)
+#	define VECI_DIFF_8(a, b) (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff)
+#elif SIMD_ISA == ISA_AVX2
+#	define SIMD_SUFFIX avx2
+#	define VEC_BYTES 32
+#	define VEC __m256
+#	define VEC_SET1(x) _mm256_set1_ps(x)
+#	define VEC_BROADCAST(p) _mm256_broadcast_ss(p)
+#	define VEC_LOADU(p) _mm256_loadu_ps(p)
+#	define VEC_STORE(p, v) _mm256_store_ps(p, v)
+#	define VEC_STOREU(p, v) _mm256_storeu_ps(p, v)
+#	define VEC_ADD(a, b) _mm256_add_ps(a, b)
+#	define VEC_MUL(a, b) _mm256_mul_ps(a, b)
+#	define VEC_DIFF(a, b) _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NEQ_UQ))
+#	define MADD_PS(a, b, c) _mm256_fmadd_ps(a, b, c)
+#	define MADD_SS(a, b, c) fmaf(a, b, c)
+#	define VECI __m256i
+#	define VECI_ZERO() _mm256_setzero_si256()
+#	define VECI_SET1_16(x) _mm256_set1_epi16(x)
+#	define VECI_LOADU(p) _mm256_loadu_si256((__m256i *) (p))
+#	define VECI_STOREU(p, v) _mm256_storeu_si256((__m256i *) (p), v)
+#	define VECI_ADD_16(a, b) _mm256_add_epi16(a, b)
+#	define VECI_MADDUBS_16(a, b) _mm256_maddubs_epi16(a, b)
+#	define VECI_UNPACKLO_8(a, b) _mm256_unpacklo_epi8(a, b)
+#	define VECI_UNPACKHI_8(a, b) _mm256_unpackhi_epi8(a, b)
+#	define VECI_SRL_16(a, count) _mm256_srl_epi16(a, count)
+#	define VECI_SRA_16(a, count) _mm256_sra_epi16(a, count)
+#	define VECI_MIN_U16(a, b) _mm256_min_epu16(a, b)
+#	define VECI_PACKUS_16(a, b) _mm256_packus_epi16(a, b)
+#	define VECI_DIFF_8(a, b) (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) != -1)
+#elif SIMD_ISA == ISA_AVX512
+#	define SIMD_SUFFIX avx512
+#	define VEC_BYTES 64
+#	define VEC __m512
+#	define VEC_SET1(x) _mm512_set1_ps(x)
+#	define VEC_BROADCAST(p) _mm512_set1_ps(*(p))
+#	define VEC_LOADU(p) _mm512_loadu_ps(p)
+#	define VEC_STORE(p, v) _mm512_store_ps(p, v)
+#	define VEC_STOREU(p, v) _mm512_storeu_ps(p, v)
+#	define VEC_ADD(a, b) _mm512_add_ps(a, b)
+#	define VEC_MUL(a, b) _mm512_mul_ps(a, b)
+#	define VEC_DIFF(a, b) _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ)
+#	define MADD_PS(a, b, c) _mm512_fmadd_ps(a, b, c)
+#	define MADD_SS(a, b, c) fmaf(a, b, c)
+#	define VECI __m512i
+#	define VECI_ZERO() _mm512_setzero_si512()
+#	define VECI_SET1_16(x) _mm512_set1_epi16(x)
+#	define VECI_LOADU(p) _mm512_loadu_si512(p)
+#	define VECI_STOREU(p, v) _mm512_storeu_si512(p, v)
+#	define VECI_ADD_16(a, b) _mm512_add_epi16(a, b)
+#	define VECI_MADDUBS_16(a, b) _mm512_maddubs_epi16(a, b)
+#	define VECI_UNPACKLO_8(a, b) _mm512_unpacklo_epi8(a, b)
+#	define VECI_UNPACKHI_8(a, b) _mm512_unpackhi_epi8(a, b)
+#	define VECI_SRL_16(a, count) _mm512_srl_epi16(a, count)
+#	define VECI_SRA_16(a, count) _mm512_sra_epi16(a, count)
+#	define VECI_MIN_U16(a, b) _mm512_min_epu16(a, b)
+#	define VECI_PACKUS_16(a, b) _mm512_packus_epi16(a, b)
+#	define VECI_DIFF_8(a, b) (_mm512_cmpneq_epi8_mask(a, b) != 0)
+#else
+#	define SIMD_SUFFIX scalar
+#	define MADD_SS(a, b, c) ((a) * (b) + (c))
+#endif
+#define VEC_FLOATS (VEC_BYTES / (int) sizeof(float))
+#define VECI_BYTES VEC_BYTES
+
+// NOTE: Columns and 'width' are floats here and below, the taps of a row are kernel->channels apart.
+// Return whether the pixel changed.
+int SIMD_NAME(fill_pixels)(int curr_row, int curr_col, int width, float *start_data, float *cache_out, kernel_t *kernel) {
+	int radius = kernel->radius;
+	int size = kernel->size;
+	int channels = kernel->channels;
+	float pixel = kernel->bias;
+
+	if(kernel->separable) {
+		// Same order of operations as simd_separable().
+		float *top_row = start_data + (size_t) (curr_row - radius) * width;
+		for(int j = 0; j < size; ++j) {
+			int col = curr_col + (j - radius) * channels;
+			float partial = top_row[col] * kernel->col[0];
+			for(int i = 1; i < size; ++i)
+				partial = MADD_SS(top_row[i * width + col], kernel->col[i], partial);
+			pixel = MADD_SS(partial, kernel->row[j], pixel);
+		}
+	} else if(kernel->symmetric) {
+		// Same order of operations as simd_symmetric().
+		float *center = start_data + (size_t) curr_row * width + curr_col;
+		for(int dy = 0; dy <= radius; ++dy) {
+			float *above = center - dy * width;
+			float *below = center + dy * width;
+			for(int dx = 0; dx <= radius; ++dx) {
+				float weight = kernel->matrix[(radius + dy) * size + radius + dx];
+				if(weight == 0.0f)
+					continue;
+				float taps = dy ? above[-dx * channels] + below[-dx * channels] : above[-dx * channels];
+				if(dx)
+					taps += dy ? above[dx * channels] + below[dx * channels] : above[dx * channels];
+				pixel = MADD_SS(weight, taps, pixel);
+			}
+		}
+	} else {
+		int k = 0;
+		// Gather the surrounding pixels for each source pixel.
+		for(int i = curr_row - radius; i <= curr_row + radius; ++i)
+			for(int j = curr_col - radius * channels; j <= curr_col + radius * channels; j += channels)
+				pixel = MADD_SS(start_data[(size_t) i * width + j], kernel->matrix[k++], pixel);
+	}
+
+	size_t pos = (size_t) curr_row * width + curr_col;
+	cache_out[pos] = pixel;
+	return pixel != start_data[pos];
+}
+
+#if SIMD_ISA == ISA_SCALAR
+
+int SIMD_NAME(simd_compute)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+
+	int row, col;
+	int changed = 0;
+
+	for(row = start_row; row <= end_row; ++row)
+		for(col = start_col; col <= end_col; ++col)
+			changed |= SIMD_NAME(fill_pixels)(row, col, width, cache_in, cache_out, kernel);
+
+	return check_similarity && changed;
+}
+
+int SIMD_NAME(simd_compute_u8)(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return compute_u8(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+}
+
+#else
+
+// 2D convolution, template for kernels up to MAX_UNROLLED_SIZE.
+// The source rows are read directly and all products are accumulated in
+// registers, so each output row costs one pass over its input and one store.
+// 'channels' is kernel->channels.
+FORCE_INLINE int SIMD_NAME(simd_general_unrolled)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity, const int radius, const int channels) {
+
+// Get aligned (to a register) local variables depending on the compiler.
+#ifdef __GNUC__
+
+	VEC kernel_vec[MAX_UNROLLED_SIZE * MAX_UNROLLED_SIZE] __attribute__((aligned(VEC_BYTES)));
+	VEC acc __attribute__((aligned(VEC_BYTES)));
+
+#endif
+
+#ifdef _MSC_VER
+
+	__declspec(align(VEC_BYTES)) VEC kernel_vec[MAX_UNROLLED_SIZE * MAX_UNROLLED_SIZE];
+	__declspec(align(VEC_BYTES)) VEC acc;
+
+#endif
+
+	const int size = 2 * radius + 1;
+
+	// Repeat each kernel value in an 8-wide register
+	for(int k = 0; k < size * size; ++k)
+		kernel_vec[k] = VEC_SET1(kernel->matrix[k]);
+	VEC bias = VEC_SET1(kernel->bias);
+
+	int changed = 0;
+
+	for(int row = start_row; row <= end_row; ++row) {
+		float *top_row = cache_in + (size_t) (row - radius) * width - radius * channels;
+		float *center = cache_in + (size_t) row * width;
+		float *out = cache_out + (size_t) row * width;
+
+		int col;
+		for(col = start_col; col <= end_col - (VEC_FLOATS - 1); col += VEC_FLOATS) {
+			acc = bias;
+			UNROLL
+			for(int i = 0; i < size; ++i) {
+				// Unaligned loads, the taps of each row are 'channels' floats apart.
+				float *in = top_row + i * width + col;
+				UNROLL
+				for(int j = 0; j < size; ++j)
+					acc = MADD_PS(kernel_vec[i * size + j], VEC_LOADU(in + j * channels), acc);
+			}
+			VEC_STOREU(out + col, acc);
+			if(check_similarity)
+				changed |= VEC_DIFF(acc, VEC_LOADU(center + col));
+		}
+
+		// Handle what has remained in scalar.
+		while(col <= end_col) {
+			changed |= SIMD_NAME(fill_pixels)(row, col, width, cache_in, cache_out, kernel);
+			++col;
+		}
+	}
+
+	return check_similarity && changed;
+}
+
+// 2D convolution for bigger kernels. Kernel values are broadcast from memory
+// as they are needed, as they don't fit in registers anyway.
+int SIMD_NAME(simd_general)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+
+// Get aligned (to a register) local variables depending on the compiler.
+#ifdef __GNUC__
+
+	VEC acc __attribute__((aligned(VEC_BYTES)));
+
+#endif
+
+#ifdef _MSC_VER
+
+	__declspec(align(VEC_BYTES)) VEC acc;
+
+#endif
+
+	int radius = kernel->radius;
+	int size = kernel->size;
+	int channels = kernel->channels;
+	VEC bias = VEC_SET1(kernel->bias);
+
+	int changed = 0;
+
+	for(int row = start_row; row <= end_row; ++row) {
+		float *top_row = cache_in + (size_t) (row - radius) * width - radius * channels;
+		float *center = cache_in + (size_t) row * width;
+		float *out = cache_out + (size_t) row * width;
+
+		int col;
+		for(col = start_col; col <= end_col - (VEC_FLOATS - 1); col += VEC_FLOATS) {
+			float *weight = kernel->matrix;
+			acc = bias;
+			for(int i = 0; i < size; ++i) {
+				float *in = top_row + i * width + col;
+				for(int j = 0; j < size; ++j)
+					acc = MADD_PS(VEC_BROADCAST(weight++), VEC_LOADU(in + j * channels), acc);
+			}
+			VEC_STOREU(out + col, acc);
+			if(check_similarity)
+				changed |= VEC_DIFF(acc, VEC_LOADU(center + col));
+		}
+
+		// Handle what has remained in scalar.
+		while(col <= end_col) {
+			changed |= SIMD_NAME(fill_pixels)(row, col, width, cache_in, cache_out, kernel);
+			++col;
+		}
+	}
+
+	return check_similarity && changed;
+}
+
+// 2D convolution with a separable kernel, i.e. col (x) row, template.
+// For each output row, the source rows are first combined vertically and
+// then the partial sums are combined horizontally, 2 * size multiply-adds
+// instead of size^2. Partial sums are computed in chunks of columns so that they stay in L1.
+// 'channels' is kernel->channels.
+FORCE_INLINE int SIMD_NAME(simd_separable_template)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity, const int radius, const int channels) {
+
+// Get aligned (to a register) local variables depending on the compiler.
+#ifdef __GNUC__
+
+	VEC col_vec[MAX_KERNEL_SIZE] __attribute__((aligned(VEC_BYTES)));
+	VEC row_vec[MAX_KERNEL_SIZE] __attribute__((aligned(VEC_BYTES)));
+	VEC acc __attribute__((aligned(VEC_BYTES)));
+	float partial[SEPARABLE_CHUNK + 2 * MAX_KERNEL_RADIUS * MAX_INTERLEAVED_CHANNELS] __attribute__((aligned(VEC_BYTES)));
+
+#endif
+
+#ifdef _MSC_VER
+
+	__declspec(align(VEC_BYTES)) VEC col_vec[MAX_KERNEL_SIZE];
+	__declspec(align(VEC_BYTES)) VEC row_vec[MAX_KERNEL_SIZE];
+	__declspec(align(VEC_BYTES)) VEC acc;
+	__declspec(align(VEC_BYTES)) float partial[SEPARABLE_CHUNK + 2 * MAX_KERNEL_RADIUS * MAX_INTERLEAVED_CHANNELS];
+
+#endif
+
+	const int size = 2 * radius + 1;
+	// Columns that the taps reach on each side.
+	const int reach = radius * channels;
+
+	for(int k = 0; k < size; ++k) {
+		col_vec[k] = VEC_SET1(kernel->col[k]);
+		row_vec[k] = VEC_SET1(kernel->row[k]);
+	}
+	VEC bias = VEC_SET1(kernel->bias);
+	int changed = 0;
+
+	for(int row = start_row; row <= end_row; ++row) {
+		float *top_row = cache_in + (size_t) (row - radius) * width;
+		float *center = cache_in + (size_t) row * width;
+		float *out = cache_out + (size_t) row * width;
+
+		for(int chunk = start_col; chunk <= end_col; chunk += SEPARABLE_CHUNK) {
+			int length = end_col - chunk + 1;
+			if(length > SEPARABLE_CHUNK)
+				length = SEPARABLE_CHUNK;
+
+			// Vertical pass on length + 2 * reach columns, starting reach columns to the left.
+			// partial[i] holds the sum for column chunk - reach + i.
+			int i;
+			for(i = 0; i <= length + 2 * reach - VEC_FLOATS; i += VEC_FLOATS) {
+				float *in = top_row + chunk - reach + i;
+				acc = VEC_MUL(VEC_LOADU(in), col_vec[0]);
+				UNROLL
+				for(int k = 1; k < size; ++k)
+					acc = MADD_PS(VEC_LOADU(in + k * width), col_vec[k], acc);
+				VEC_STORE(partial + i, acc);
+			}
+			for(; i < length + 2 * reach; ++i) {
+				float *in = top_row + chunk - reach + i;
+				float sum = in[0] * kernel->col[0];
+				for(int k = 1; k < size; ++k)
+					sum = MADD_SS(in[k * width], kernel->col[k], sum);
+				partial[i] = sum;
+			}
+
+			// Horizontal pass.
+			for(i = 0; i <= length - VEC_FLOATS; i += VEC_FLOATS) {
+				acc = MADD_PS(VEC_LOADU(partial + i), row_vec[0], bias);
+				UNROLL
+				for(int k = 1; k < size; ++k)
+					acc = MADD_PS(VEC_LOADU(partial + i + k * channels), row_vec[k], acc);
+				VEC_STOREU(out + chunk + i, acc);
+				if(check_similarity)
+					changed |= VEC_DIFF(acc, VEC_LOADU(center + chunk + i));
+			}
+			for(; i < length; ++i) {
+				float pixel = MADD_SS(partial[i], kernel->row[0], kernel->bias);
+				for(int k = 1; k < size; ++k)
+					pixel = MADD_SS(partial[i + k * channels], kernel->row[k], pixel);
+				out[chunk + i] = pixel;
+				changed |= (pixel != center[chunk + i]);
+			}
+		}
+	}
+
+	return check_similarity && changed;
+}
+
+int SIMD_NAME(simd_separable)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_separable_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, kernel->radius, kernel->channels);
+}
+
+// Specializations for the common kernel sizes.
+
+int SIMD_NAME(simd_general_3x3)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_general_unrolled)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 1, 1);
+}
+
+int SIMD_NAME(simd_general_5x5)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_general_unrolled)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2, 1);
+}
+
+int SIMD_NAME(simd_general_7x7)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_general_unrolled)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3, 1);
+}
+
+int SIMD_NAME(simd_separable_3x3)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_separable_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 1, 1);
+}
+
+int SIMD_NAME(simd_separable_5x5)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_separable_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2, 1);
+}
+
+int SIMD_NAME(simd_separable_7x7)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_separable_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3, 1);
+}
+
+// 2D convolution with a symmetric kernel (the same upside down and mirrored) that isn't separable,
+// like the Laplacian or a difference of gaussians, template. The (up to) 4 pixels that share a weight
+// are added up first, so there are (radius + 1)^2 weights, which fit in registers up to 7x7, and
+// multiply-adds, instead of size^2. Zero weights are skipped. 'channels' is kernel->channels.
+// If not 'unrolled', the weights are broadcast from memory as they are needed.
+FORCE_INLINE int SIMD_NAME(simd_symmetric_template)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity, const int radius, const int channels, const int unrolled) {
+
+// Get aligned (to a register) local variables depending on the compiler.
+#ifdef __GNUC__
+
+	VEC weight_vec[MAX_UNROLLED_PAIRS * MAX_UNROLLED_PAIRS] __attribute__((aligned(VEC_BYTES)));
+	VEC acc __attribute__((aligned(VEC_BYTES)));
+
+#endif
+
+#ifdef _MSC_VER
+
+	__declspec(align(VEC_BYTES)) VEC weight_vec[MAX_UNROLLED_PAIRS * MAX_UNROLLED_PAIRS];
+	__declspec(align(VEC_BYTES)) VEC acc;
+
+#endif
+
+	const int size = 2 * radius + 1;
+	const int taps = radius + 1;
+	// The bottom right quarter of the kernel, and which of its weights aren't 0 (if unrolled).
+	float weights[(MAX_KERNEL_RADIUS + 1) * (MAX_KERNEL_RADIUS + 1)];
+	int nonzero = 0;
+	for(int dy = 0; dy < taps; ++dy) {
+		for(int dx = 0; dx < taps; ++dx) {
+			int k = dy * taps + dx;
+			weights[k] = kernel->matrix[(radius + dy) * size + radius + dx];
+			if(unrolled) {
+				weight_vec[k] = VEC_SET1(weights[k]);
+				nonzero |= (weights[k] != 0.0f) << k;
+			}
+		}
+	}
+	VEC bias = VEC_SET1(kernel->bias);
+	int changed = 0;
+
+	for(int row = start_row; row <= end_row; ++row) {
+		float *center = cache_in + (size_t) row * width;
+		float *out = cache_out + (size_t) row * width;
+
+		int col;
+		for(col = start_col; col <= end_col - (VEC_FLOATS - 1); col += VEC_FLOATS) {
+			acc = bias;
+			UNROLL
+			for(int dy = 0; dy < taps; ++dy) {
+				float *above = center - dy * width + col;
+				float *below = center + dy * width + col;
+				UNROLL
+				for(int dx = 0; dx < taps; ++dx) {
+					int k = dy * taps + dx;
+					if(unrolled ? !(nonzero & (1 << k)) : (weights[k] == 0.0f))
+						continue;
+					// Fold the rows, then the columns, as fill_pixels().
+					VEC sum = VEC_LOADU(above - dx * channels);
+					if(dy)
+						sum = VEC_ADD(sum, VEC_LOADU(below - dx * channels));
+					if(dx) {
+						VEC right = VEC_LOADU(above + dx * channels);
+						if(dy)
+							right = VEC_ADD(right, VEC_LOADU(below + dx * channels));
+						sum = VEC_ADD(sum, right);
+					}
+					acc = MADD_PS(unrolled ? weight_vec[k] : VEC_BROADCAST(&weights[k]), sum, acc);
+				}
+			}
+			VEC_STOREU(out + col, acc);
+			if(check_similarity)
+				changed |= VEC_DIFF(acc, VEC_LOADU(center + col));
+		}
+
+		// Handle what has remained in scalar.
+		while(col <= end_col) {
+			changed |= SIMD_NAME(fill_pixels)(row, col, width, cache_in, cache_out, kernel);
+			++col;
+		}
+	}
+
+	return check_similarity && changed;
+}
+
+int SIMD_NAME(simd_symmetric)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_symmetric_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, kernel->radius, kernel->channels, 0);
+}
+
+int SIMD_NAME(simd_symmetric_3x3)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_symmetric_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 1, 1, 1);
+}
+
+int SIMD_NAME(simd_symmetric_5x5)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_symmetric_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2, 1, 1);
+}
+
+int SIMD_NAME(simd_symmetric_7x7)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_symmetric_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3, 1, 1);
+}
+
+// Interleaved pixels of 'channels' (2 to MAX_INTERLEAVED_CHANNELS) floats, template for the
+// common kernel sizes. With 4 channels, a register holds 2 RGBA pixels, with 3, 2 and 2/3 RGB pixels.
+FORCE_INLINE int SIMD_NAME(simd_interleaved_template)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity, const int channels) {
+	switch(kernel->radius) {
+	case 1:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 1, channels);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 1, channels, 1);
+		else
+			return SIMD_NAME(simd_general_unrolled)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 1, channels);
+	case 2:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2, channels);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2, channels, 1);
+		else
+			return SIMD_NAME(simd_general_unrolled)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2, channels);
+	case 3:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3, channels);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3, channels, 1);
+		else
+			return SIMD_NAME(simd_general_unrolled)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3, channels);
+	default:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else
+			return SIMD_NAME(simd_general)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	}
+}
+
+int SIMD_NAME(simd_interleaved_2)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_interleaved_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2);
+}
+
+int SIMD_NAME(simd_interleaved_3)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_interleaved_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3);
+}
+
+int SIMD_NAME(simd_interleaved_4)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_interleaved_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 4);
+}
+
+int SIMD_NAME(simd_compute)(float *cache_in, float *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	switch(kernel->channels) {
+	case 2:
+		return SIMD_NAME(simd_interleaved_2)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	case 3:
+		return SIMD_NAME(simd_interleaved_3)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	case 4:
+		return SIMD_NAME(simd_interleaved_4)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	}
+
+	switch(kernel->radius) {
+	case 1:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable_3x3)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric_3x3)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else
+			return SIMD_NAME(simd_general_3x3)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	case 2:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable_5x5)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric_5x5)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else
+			return SIMD_NAME(simd_general_5x5)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	case 3:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable_7x7)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric_7x7)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else
+			return SIMD_NAME(simd_general_7x7)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	default:
+		if(kernel->separable)
+			return SIMD_NAME(simd_separable)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else if(kernel->symmetric)
+			return SIMD_NAME(simd_symmetric)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+		else
+			return SIMD_NAME(simd_general)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	}
+}
+
+// Template of the fixed point convolution. Horizontally adjacent taps are interleaved
+// byte by byte and each pair is multiplied and added with one maddubs (unsigned
+// pixels times signed weights) into 16-bit sums. fit_fixed_point() guarantees that these don't overflow
+// (as unsigned sums, if no weight is negative).
+// NOTE: unpacklo / unpackhi work within 128-bit lanes, but packus does too,
+// so packing the 'lo' and 'hi' sums puts the pixels back in order.
+FORCE_INLINE int SIMD_NAME(simd_u8_template)(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity, const int radius, const int unrolled) {
+
+// Get aligned (to a register) local variables depending on the compiler.
+#ifdef __GNUC__
+
+	VECI pair_vec[MAX_UNROLLED_SIZE * MAX_UNROLLED_PAIRS] __attribute__((aligned(VEC_BYTES)));
+	VECI lo __attribute__((aligned(VEC_BYTES)));
+	VECI hi __attribute__((aligned(VEC_BYTES)));
+
+#endif
+
+#ifdef _MSC_VER
+
+	__declspec(align(VEC_BYTES)) VECI pair_vec[MAX_UNROLLED_SIZE * MAX_UNROLLED_PAIRS];
+	__declspec(align(VEC_BYTES)) VECI lo;
+	__declspec(align(VEC_BYTES)) VECI hi;
+
+#endif
+
+	const int size = 2 * radius + 1;
+	const int pairs = radius + 1;
+	__m128i shift = _mm_cvtsi32_si128(kernel->shift);
+	VECI zero = VECI_ZERO();
+	VECI bias = VECI_SET1_16((int16_t) kernel->int_bias);
+	VECI max_pixel = VECI_SET1_16(255);
+	int changed = 0;
+
+	if(unrolled)
+		for(int k = 0; k < size * pairs; ++k)
+			pair_vec[k] = VECI_SET1_16(kernel->pair_weights[k]);
+
+	for(int row = start_row; row <= end_row; ++row) {
+		uint8_t *top_row = cache_in + (size_t) (row - radius) * width - radius;
+		uint8_t *center = cache_in + (size_t) row * width;
+		uint8_t *out = cache_out + (size_t) row * width;
+
+		int col;
+		for(col = start_col; col <= end_col - (VECI_BYTES - 1); col += VECI_BYTES) {
+			lo = bias;
+			hi = bias;
+			UNROLL
+			for(int i = 0; i < size; ++i) {
+				uint8_t *in = top_row + i * width + col;
+				UNROLL
+				for(int p = 0; p < pairs; ++p) {
+					VECI weights = unrolled ? pair_vec[i * pairs + p] : VECI_SET1_16(kernel->pair_weights[i * pairs + p]);
+					VECI first = VECI_LOADU(in + 2 * p);
+					// The last tap of the row has no pair, its weight is paired with 0.
+					VECI second = (2 * p + 1 < size) ? VECI_LOADU(in + 2 * p + 1) : zero;
+					lo = VECI_ADD_16(lo, VECI_MADDUBS_16(VECI_UNPACKLO_8(first, second), weights));
+					hi = VECI_ADD_16(hi, VECI_MADDUBS_16(VECI_UNPACKHI_8(first, second), weights));
+				}
+			}
+			if(kernel->unsigned_sums) {
+				// NOTE: packus takes the sums as signed, so one above INT16_MAX would be 0 instead
+				// of 255. Clamp them to 255 first.
+				lo = VECI_MIN_U16(VECI_SRL_16(lo, shift), max_pixel);
+				hi = VECI_MIN_U16(VECI_SRL_16(hi, shift), max_pixel);
+			} else {
+				lo = VECI_SRA_16(lo, shift);
+				hi = VECI_SRA_16(hi, shift);
+			}
+			VECI pixels = VECI_PACKUS_16(lo, hi);
+			VECI_STOREU(out + col, pixels);
+			if(check_similarity)
+				changed |= VECI_DIFF_8(pixels, VECI_LOADU(center + col));
+		}
+
+		// Handle what has remained in scalar.
+		while(col <= end_col) {
+			changed |= fill_pixels_u8(row, col, width, cache_in, cache_out, kernel);
+			++col;
+		}
+	}
+
+	return check_similarity && changed;
+}
+
+int SIMD_NAME(simd_u8_3x3)(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_u8_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 1, 1);
+}
+
+int SIMD_NAME(simd_u8_5x5)(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_u8_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 2, 1);
+}
+
+int SIMD_NAME(simd_u8_7x7)(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_u8_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, 3, 1);
+}
+
+int SIMD_NAME(simd_u8)(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	return SIMD_NAME(simd_u8_template)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity, kernel->radius, 0);
+}
+
+int SIMD_NAME(simd_compute_u8)(uint8_t *cache_in, uint8_t *cache_out, int start_row, int end_row, int start_col, int end_col, int width, kernel_t *kernel, int check_similarity) {
+	switch(kernel->radius) {
+	case 1:
+		return SIMD_NAME(simd_u8_3x3)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	case 2:
+		return SIMD_NAME(simd_u8_5x5)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	case 3:
+		return SIMD_NAME(simd_u8_7x7)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	default:
+		return SIMD_NAME(simd_u8)(cache_in, cache_out, start_row, end_row, start_col, end_col, width, kernel, check_similarity);
+	}
+}
+
+#endif
+
+// The color planes (the split of the pixels into them and back) and the columns of the
+// packed halos, see Split_rows() and Halo_start() in mpi_simd.c.
+
+#if SIMD_ISA != ISA_SCALAR
+
+// Split 16 RGB pixels to 16 bytes of each color, with the masks of RGB_SPLIT.
+FORCE_INLINE void SIMD_NAME(deinterleave_rgb)(uint8_t *in, __m128i colors[3]) {
+	__m128i part[3];
+	for(int j = 0; j < 3; ++j)
+		part[j] = _mm_loadu_si128((__m128i *) (in + 16 * j));
+	for(int k = 0; k < 3; ++k) {
+		colors[k] = _mm_shuffle_epi8(part[0], _mm_loadu_si128((__m128i *) RGB_SPLIT[k][0]));
+		colors[k] = _mm_or_si128(colors[k], _mm_shuffle_epi8(part[1], _mm_loadu_si128((__m128i *) RGB_SPLIT[k][1])));
+		colors[k] = _mm_or_si128(colors[k], _mm_shuffle_epi8(part[2], _mm_loadu_si128((__m128i *) RGB_SPLIT[k][2])));
+	}
+}
+
+FORCE_INLINE void SIMD_NAME(interleave_rgb)(__m128i colors[3], uint8_t *out) {
+	for(int j = 0; j < 3; ++j) {
+		__m128i part = _mm_shuffle_epi8(colors[0], _mm_loadu_si128((__m128i *) RGB_MERGE[0][j]));
+		part = _mm_or_si128(part, _mm_shuffle_epi8(colors[1], _mm_loadu_si128((__m128i *) RGB_MERGE[1][j])));
+		part = _mm_or_si128(part, _mm_shuffle_epi8(colors[2], _mm_loadu_si128((__m128i *) RGB_MERGE[2][j])));
+		_mm_storeu_si128((__m128i *) (out + 16 * j), part);
+	}
+}
+
+// Split 16 RGBA pixels to 16 bytes of each color. Every 4 pixels become 4 bytes of each color,
+// then those are transposed as 32-bit values.
+FORCE_INLINE void SIMD_NAME(deinterleave_rgba)(uint8_t *in, __m128i colors[4]) {
+	__m128i transpose = _mm_loadu_si128((__m128i *) RGBA_TRANSPOSE);
+	__m128i part[4];
+	for(int j = 0; j < 4; ++j)
+		part[j] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (in + 16 * j)), transpose);
+	__m128i rg_low = _mm_unpacklo_epi32(part[0], part[1]);
+	__m128i ba_low = _mm_unpackhi_epi32(part[0], part[1]);
+	__m128i rg_high = _mm_unpacklo_epi32(part[2], part[3]);
+	__m128i ba_high = _mm_unpackhi_epi32(part[2], part[3]);
+	colors[0] = _mm_unpacklo_epi64(rg_low, rg_high);
+	colors[1] = _mm_unpackhi_epi64(rg_low, rg_high);
+	colors[2] = _mm_unpacklo_epi64(ba_low, ba_high);
+	colors[3] = _mm_unpackhi_epi64(ba_low, ba_high);
+}
+
+FORCE_INLINE void SIMD_NAME(interleave_rgba)(__m128i colors[4], uint8_t *out) {
+	__m128i transpose = _mm_loadu_si128((__m128i *) RGBA_TRANSPOSE);
+	__m128i rg_low = _mm_unpacklo_epi32(colors[0], colors[1]);
+	__m128i rg_high = _mm_unpackhi_epi32(colors[0], colors[1]);
+	__m128i ba_low = _mm_unpacklo_epi32(colors[2], colors[3]);
+	__m128i ba_high = _mm_unpackhi_epi32(colors[2], colors[3]);
+	__m128i part[4];
+	part[0] = _mm_unpacklo_epi64(rg_low, ba_low);
+	part[1] = _mm_unpackhi_epi64(rg_low, ba_low);
+	part[2] = _mm_unpacklo_epi64(rg_high, ba_high);
+	part[3] = _mm_unpackhi_epi64(rg_high, ba_high);
+	for(int j = 0; j < 4; ++j)
+		_mm_storeu_si128((__m128i *) (out + 16 * j), _mm_shuffle_epi8(part[j], transpose));
+}
+
+// Store 16 bytes as 16 floats.
+FORCE_INLINE void SIMD_NAME(store_as_floats)(float *out, __m128i bytes) {
+#if SIMD_ISA == ISA_SSE41
+	for(int i = 0; i < 16; i += 4) {
+		_mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(bytes)));
+		bytes = _mm_srli_si128(bytes, 4);
+	}
+#elif SIMD_ISA == ISA_AVX2
+	_mm256_storeu_ps(out, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)));
+	_mm256_storeu_ps(out + 8, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8))));
+#else
+	_mm512_storeu_ps(out, _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes)));
+#endif
+}
+
+// Load 16 floats as 16 bytes, the same as the scalar code: clamped to [0, 255] and truncated.
+FORCE_INLINE __m128i SIMD_NAME(load_as_bytes)(float *in) {
+#if SIMD_ISA == ISA_SSE41
+	__m128 zero = _mm_setzero_ps();
+	__m128 max = _mm_set1_ps(255.0f);
+	__m128i ints[4];
+	for(int i = 0; i < 4; ++i)
+		ints[i] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + 4 * i), zero), max));
+	return _mm_packus_epi16(_mm_packus_epi32(ints[0], ints[1]), _mm_packus_epi32(ints[2], ints[3]));
+#elif SIMD_ISA == ISA_AVX2
+	__m256 zero = _mm256_setzero_ps();
+	__m256 max = _mm256_set1_ps(255.0f);
+	__m256i low = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in), zero), max));
+	__m256i high = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + 8), zero), max));
+	// The packs work within 128-bit lanes, put the 64-bit parts back in order in between.
+	__m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+#else
+	__m512 clamped = _mm512_min_ps(_mm512_max_ps(_mm512_loadu_ps(in), _mm512_setzero_ps()), _mm512_set1_ps(255.0f));
+	return _mm512_cvtepi32_epi8(_mm512_cvttps_epi32(clamped));
+#endif
+}
+
+#endif
+
+// Split 'count' rows of the block, starting at 'first_row', so that bytes of the same color are
+// packed together (So, first the bytes of red, then green and so on...), in their padded planes,
+// as floats or bytes. RGB and RGBA pixels are split 16 at a time with SIMD shuffles.
+FORCE_INLINE void SIMD_NAME(split_colors_template)(image_info_t *image_info, uint8_t *in, int first_row, int count, uint8_t *out, const int to_float) {
+	int cols = image_info->cols;
+	int bytes_per_pixel = image_info->bytes_per_pixel;
+	int padding = image_info->padding;
+	int padded_cols = cols + 2 * padding;
+	size_t elem_size = to_float ? sizeof(float) : sizeof(uint8_t);
+	size_t plane_bytes = (size_t) (image_info->rows + 2 * padding) * padded_cols * elem_size;
+
+	for(int row = first_row; row != first_row + count; ++row) {
+		// skip the padding lines and the left padding pixels
+		uint8_t *out_row = out + ((size_t) (padding + row) * padded_cols + padding) * elem_size;
+
+		int col = 0;
+#if SIMD_ISA != ISA_SCALAR
+		if(bytes_per_pixel == 3 || bytes_per_pixel == 4) {
+			__m128i colors[4];
+			for(; col <= cols - 16; col += 16) {
+				if(bytes_per_pixel == 3)
+					SIMD_NAME(deinterleave_rgb)(in + col * 3, colors);
+				else
+					SIMD_NAME(deinterleave_rgba)(in + col * 4, colors);
+				for(int color = 0; color != bytes_per_pixel; ++color) {
+					uint8_t *plane = out_row + color * plane_bytes;
+					if(to_float)
+						SIMD_NAME(store_as_floats)((float *) plane + col, colors[color]);
+					else
+						_mm_storeu_si128((__m128i *) (plane + col), colors[color]);
+				}
+			}
+		}
+#endif
+
+		// NOTE(stefanos): For each color, each of its bytes is bytes_per_pixel
+		// apart from the next.
+		for(; col < cols; ++col) {
+			for(int color = 0; color != bytes_per_pixel; ++color) {
+				uint8_t *plane = out_row + color * plane_bytes;
+				if(to_float)
+					((float *) plane)[col] = (float) in[col * bytes_per_pixel + color];
+				else
+					plane[col] = in[col * bytes_per_pixel + color];
+			}
+		}
+		in += (size_t) cols * bytes_per_pixel;
+	}
+}
+
+// The opposite of split_colors_template(). Floats are clamped to [0, 255].
+FORCE_INLINE void SIMD_NAME(recombine_colors_template)(image_info_t *image_info, uint8_t *in, int first_row, int count, uint8_t *out, const int from_float) {
+	int cols = image_info->cols;
+	int bytes_per_pixel = image_info->bytes_per_pixel;
+	int padding = image_info->padding;
+	int padded_cols = cols + 2 * padding;
+	size_t elem_size = from_float ? sizeof(float) : sizeof(uint8_t);
+	size_t plane_bytes = (size_t) (image_info->rows + 2 * padding) * padded_cols * elem_size;
+
+	for(int row = first_row; row != first_row + count; ++row) {
+		uint8_t *in_row = in + ((size_t) (padding + row) * padded_cols + padding) * elem_size;
+
+		int col = 0;
+#if SIMD_ISA != ISA_SCALAR
+		if(bytes_per_pixel == 3 || bytes_per_pixel == 4) {
+			__m128i colors[4];
+			for(; col <= cols - 16; col += 16) {
+				for(int color = 0; color != bytes_per_pixel; ++color) {
+					uint8_t *plane = in_row + color * plane_bytes;
+					if(from_float)
+						colors[color] = SIMD_NAME(load_as_bytes)((float *) plane + col);
+					else
+						colors[color] = _mm_loadu_si128((__m128i *) (plane + col));
+				}
+				if(bytes_per_pixel == 3)
+					SIMD_NAME(interleave_rgb)(colors, out + col * 3);
+				else
+					SIMD_NAME(interleave_rgba)(colors, out + col * 4);
+			}
+		}
+#endif
+
+		for(; col < cols; ++col) {
+			for(int color = 0; color != bytes_per_pixel; ++color) {
+				uint8_t *plane = in_row + color * plane_bytes;
+				if(from_float) {
+					float value = ((float *) plane)[col];
+					out[col * bytes_per_pixel + color] = (value <= 0.0f) ? 0 : (value >= 255.0f) ? 255 : (uint8_t) value;
+				} else {
+					out[col * bytes_per_pixel + color] = plane[col];
+				}
+			}
+		}
+		out += (size_t) cols * bytes_per_pixel;
+	}
+}
+
+// For the interleaved layout, convert 'count' rows of the block, starting at 'first_row',
+// to floats in the padded plane of whole pixels. The colors stay in place.
+FORCE_INLINE void SIMD_NAME(pixels_to_floats)(image_info_t *image_info, uint8_t *in, int first_row, int count, float *out) {
+	int bytes_per_pixel = image_info->bytes_per_pixel;
+	int row_elems = image_info->cols * bytes_per_pixel;
+	int padding = image_info->padding;
+	int padded_row_elems = row_elems + 2 * padding * bytes_per_pixel;
+
+	for(int row = first_row; row != first_row + count; ++row) {
+		float *out_row = out + (size_t) (padding + row) * padded_row_elems + padding * bytes_per_pixel;
+		int i = 0;
+#if SIMD_ISA != ISA_SCALAR
+		for(; i <= row_elems - 16; i += 16)
+			SIMD_NAME(store_as_floats)(out_row + i, _mm_loadu_si128((__m128i *) (in + i)));
+#endif
+		for(; i < row_elems; ++i)
+			out_row[i] = (float) in[i];
+		in += row_elems;
+	}
+}
+
+// The opposite of pixels_to_floats(), with the same clamp as recombine_colors_template().
+FORCE_INLINE void SIMD_NAME(floats_to_pixels)(image_info_t *image_info, float *in, int first_row, int count, uint8_t *out) {
+	int bytes_per_pixel = image_info->bytes_per_pixel;
+	int row_elems = image_info->cols * bytes_per_pixel;
+	int padding = image_info->padding;
+	int padded_row_elems = row_elems + 2 * padding * bytes_per_pixel;
+
+	for(int row = first_row; row != first_row + count; ++row) {
+		float *in_row = in + (size_t) (padding + row) * padded_row_elems + padding * bytes_per_pixel;
+		int i = 0;
+#if SIMD_ISA != ISA_SCALAR
+		for(; i <= row_elems - 16; i += 16)
+			_mm_storeu_si128((__m128i *) (out + i), SIMD_NAME(load_as_bytes)(in_row + i));
+#endif
+		for(; i < row_elems; ++i) {
+			float value = in_row[i];
+			out[i] = (value <= 0.0f) ? 0 : (value >= 255.0f) ? 255 : (uint8_t) value;
+		}
+		out += row_elems;
+	}
+}
+
+// Split_rows() for this instruction set.
+void SIMD_NAME(split_rows)(image_info_t *image_info, input_data_t *input_data, size_t elem_size, uint8_t *in, int first_row, int count, uint8_t *planes) {
+	if(input_data->layout == LAYOUT_INTERLEAVED)
+		SIMD_NAME(pixels_to_floats)(image_info, in, first_row, count, (float *) planes);
+	else if(elem_size == sizeof(float))
+		SIMD_NAME(split_colors_template)(image_info, in, first_row, count, planes, 1);
+	else
+		SIMD_NAME(split_colors_template)(image_info, in, first_row, count, planes, 0);
+}
+
+// Recombine_rows() for this instruction set.
+void SIMD_NAME(recombine_rows)(image_info_t *image_info, input_data_t *input_data, size_t elem_size, uint8_t *planes, int first_row, int count, uint8_t *out) {
+	if(input_data->layout == LAYOUT_INTERLEAVED)
+		SIMD_NAME(floats_to_pixels)(image_info, (float *) planes, first_row, count, out);
+	else if(elem_size == sizeof(float))
+		SIMD_NAME(recombine_colors_template)(image_info, planes, first_row, count, out, 1);
+	else
+		SIMD_NAME(recombine_colors_template)(image_info, planes, first_row, count, out, 0);
+}
+
+// Same as pack_block() but column by column, for the narrow left / right halos of color
+// planes. Floats are gathered 8 (AVX2) or 16 (AVX-512) rows at a time.
+void SIMD_NAME(pack_columns)(halo_t *halo, uint8_t *planes, int row, int col, int rows, int cols, uint8_t *buf) {
+	int stride = halo->padded_cols;
+	for(int color = 0; color != halo->planes; ++color) {
+		int first = color * halo->padded_rows + row;
+		for(int c = 0; c != cols; ++c) {
+			if(halo->elem_size == sizeof(float)) {
+				float *in = (float *) planes + (size_t) first * stride + col + c;
+				float *out = (float *) buf + (size_t) (color * cols + c) * rows;
+				int r = 0;
+#if SIMD_ISA == ISA_AVX2
+				__m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+				for(; r <= rows - 8; r += 8)
+					_mm256_storeu_ps(out + r, _mm256_i32gather_ps(in + (size_t) r * stride, offsets, 4));
+#elif SIMD_ISA == ISA_AVX512
+				__m512i offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+				for(; r <= rows - 16; r += 16)
+					_mm512_storeu_ps(out + r, _mm512_i32gather_ps(offsets, in + (size_t) r * stride, 4));
+#endif
+				for(; r < rows; ++r)
+					out[r] = in[(size_t) r * stride];
+			} else {
+				uint8_t *in = planes + (size_t) first * stride + col + c;
+				uint8_t *out = buf + (size_t) (color * cols + c) * rows;
+				for(int r = 0; r != rows; ++r)
+					out[r] = in[(size_t) r * stride];
+			}
+		}
+	}
+}
+
+// The opposite of pack_columns(). Floats are scattered 16 rows at a time with AVX-512
+// (there's no scatter before it).
+void SIMD_NAME(unpack_columns)(halo_t *halo, uint8_t *buf, uint8_t *planes, int row, int col, int rows, int cols) {
+	int stride = halo->padded_cols;
+	for(int color = 0; color != halo->planes; ++color) {
+		int first = color * halo->padded_rows + row;
+		for(int c = 0; c != cols; ++c) {
+			if(halo->elem_size == sizeof(float)) {
+				float *in = (float *) buf + (size_t) (color * cols + c) * rows;
+				float *out = (float *) planes + (size_t) first * stride + col + c;
+				int r = 0;
+#if SIMD_ISA == ISA_AVX512
+				__m512i offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(stride));
+				for(; r <= rows - 16; r += 16)
+					_mm512_i32scatter_ps(out + (size_t) r * stride, offsets, _mm512_loadu_ps(in + r), 4);
+#endif
+				for(; r < rows; ++r)
+					out[(size_t) r * stride] = in[r];
+			} else {
+				uint8_t *in = buf + (size_t) (color * cols + c) * rows;
+				uint8_t *out = planes + (size_t) first * stride + col + c;
+				for(int r = 0; r != rows; ++r)
+					out[(size_t) r * stride] = in[r];
+			}
+		}
+	}
+}
+
+#undef SIMD_SUFFIX
+#undef VEC_BYTES
+#undef VEC
+#undef VEC_SET1
+#undef VEC_BROADCAST
+#undef VEC_LOADU
+#undef VEC_STORE
+#undef VEC_STOREU
+#undef VEC_ADD
+#undef VEC_MUL
+#undef VEC_DIFF
+#undef MADD_PS
+#undef MADD_SS
+#undef VECI
+#undef VECI_ZERO
+#undef VECI_SET1_16
+#undef VECI_LOADU
+#undef VECI_STOREU
+#undef VECI_ADD_16
+#undef VECI_MADDUBS_16
+#undef VECI_UNPACKLO_8
+#undef VECI_UNPACKHI_8
+#undef VECI_SRL_16
+#undef VECI_SRA_16
+#undef VECI_MIN_U16
+#undef VECI_PACKUS_16
+#undef VECI_DIFF_8
+#undef VEC_FLOATS
+#undef VECI_BYTES
+
+#if defined(__clang__)
+#	if SIMD_ISA != ISA_SCALAR
+#		pragma clang attribute pop
+#	endif
+#elif defined(__GNUC__)
+#	pragma GCC pop_options
+#endif
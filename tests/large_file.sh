@@ -0,0 +1,86 @@
+#!/bin/sh
+# Regression test for images of more than 2 GiB, i.e. offsets in the file past 2^31.
+# Usage: tests/large_file.sh [directory of mpi and mpi_simd]   (default: .)
+# MPIEXEC (default mpiexec) and PROCS (default 4) set how they are run, e.g.
+# MPIEXEC="mpiexec --oversubscribe" on a machine with fewer cores.
+#
+# The input is a sparse file of zeros (truncate), so it takes no space on the disk, with a few
+# marker bytes that aren't 0 in the rows past 2^31 (8192 on) of every block. The image is much
+# wider than it is tall, so the grid is 1 x PROCS and every block has such rows. The runs do 0
+# iterations, so the output must be the same as the input: rows written at a wrong offset, or
+# not at all (the output is created full of zeros), leave markers out of place.
+# Each run skips itself when there isn't enough memory or disk for it.
+
+BIN=${1:-.}
+MPIEXEC=${MPIEXEC:-mpiexec}
+PROCS=${PROCS:-4}
+WIDTH=262144
+HEIGHT=8256
+SIZE=$((WIDTH * HEIGHT))
+SIZE_KB=$((SIZE / 1024))
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/large_file.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+INPUT=$DIR/in.raw
+OUTPUT=$DIR/out.raw
+truncate -s $SIZE "$INPUT" || exit 1
+# 8 columns across the width, so that every block (of up to 8) has some, in 3 rows past 2^31.
+# Each row has them further to the right, so that a row in the place of another doesn't match.
+shift=0
+for row in 8192 8223 $((HEIGHT - 1)); do
+	for col in 0 1 2 3 4 5 6 7; do
+		offset=$((row * WIDTH + col * WIDTH / 8 + shift))
+		printf '\377' | dd of="$INPUT" bs=1 seek=$offset conv=notrunc 2> /dev/null || exit 1
+	done
+	shift=$((shift + 1000))
+done
+
+# NOTE: A process keeps 2 padded copies of its block, so a whole image needs a bit more than
+# twice its size, plus what MPI itself takes per process.
+NEEDED_KB=$((SIZE_KB * 9 / 4 + PROCS * 64 * 1024))
+AVAILABLE_KB=$(awk '/^MemAvailable:/ { print $2 }' /proc/meminfo 2>/dev/null)
+DISK_KB=$(df -Pk "$DIR" | awk 'NR == 2 { print $4 }')
+
+if [ "${DISK_KB:-0}" -lt $SIZE_KB ]; then
+	echo "SKIP: the output needs $SIZE_KB KB of disk in $DIR, there are ${DISK_KB:-0} KB"
+	exit 0
+fi
+
+failed=0
+
+# run NEEDED_KB NAME ARGS...: runs one binary and checks that its output is the same as the input.
+run() {
+	needed=$1
+	name=$2
+	shift 2
+	if [ $needed -gt 0 ] && [ "${AVAILABLE_KB:-0}" -lt $needed ]; then
+		echo "SKIP: $name needs about $needed KB of memory, ${AVAILABLE_KB:-0} KB are available"
+		return
+	fi
+	if [ ! -x "$1" ]; then
+		echo "SKIP: $name, $1 was not found"
+		return
+	fi
+
+	rm -f "$OUTPUT"
+	if ! $MPIEXEC -n $PROCS "$@" > /dev/null; then
+		echo "FAIL: $name exited with an error"
+		failed=1
+	elif [ "$(wc -c < "$OUTPUT")" -ne $SIZE ]; then
+		echo "FAIL: $name wrote $(wc -c < "$OUTPUT") bytes instead of $SIZE"
+		failed=1
+	elif ! cmp -s "$OUTPUT" "$INPUT"; then
+		echo "FAIL: $name wrote pixels that aren't the ones of the input"
+		failed=1
+	else
+		echo "PASS: $name"
+	fi
+	rm -f "$OUTPUT"
+}
+
+run $NEEDED_KB mpi "$BIN/mpi" "$INPUT" $WIDTH $HEIGHT 1 0 0 --output "$OUTPUT"
+run $NEEDED_KB mpi_simd "$BIN/mpi_simd" "$INPUT" $WIDTH $HEIGHT 1 0 --output "$OUTPUT"
+# Only a few strips of 64 rows are in memory at a time.
+run 0 "mpi_simd --stream" "$BIN/mpi_simd" "$INPUT" $WIDTH $HEIGHT 1 0 --stream 64 --output "$OUTPUT"
+
+exit $failed